@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -61,15 +62,71 @@ void listen(int if_id) {
 
     gettimeofday(&time, NULL);
     tm_t = localtime(&time.tv_sec);
-    printf("[%02d:%02d:%02d.%03ld] if%d rx: len = %zu\n", tm_t->tm_hour,
-           tm_t->tm_min, tm_t->tm_sec, time.tv_usec / 1000, if_id, len);
-    for (int i = 0; i < len; i++) {
-      printf("%02x ", buf.data[i]);
-      if (i % 16 == 15) {
-        printf("\n");
+    if (len < 0) {
+      printf("nic listen failed\n");
+      return;
+    }
+    // the header is enough to tell frames apart, use bench to measure
+    printf("[%02d:%02d:%02d.%03ld] if%d rx: len = %zd, data = %02x %02x %02x "
+           "%02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n",
+           tm_t->tm_hour, tm_t->tm_min, tm_t->tm_sec, time.tv_usec / 1000,
+           if_id, len, buf.data[0], buf.data[1], buf.data[2], buf.data[3],
+           buf.data[4], buf.data[5], buf.data[6], buf.data[7], buf.data[8],
+           buf.data[9], buf.data[10], buf.data[11], buf.data[12],
+           buf.data[13]);
+  }
+}
+
+void listen_mmap(int if_id) {
+  struct nic_ring_info info;
+  struct nic_rx_frame *frames;
+  volatile struct nic_bd *bds;
+  uint32_t next;
+  uint32_t pending = 0;
+  int err;
+
+  APP_IOC_INT(fd, NIC_IOC_NR_UIO_EN, if_id);
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RW_RAW, if_id);
+  if (err) {
+    printf("nic listen failed\n");
+    return;
+  }
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RING_INFO, &info);
+  if (err) {
+    printf("nic ring info failed\n");
+    return;
+  }
+
+  frames = mmap(NULL, sizeof(struct nic_rx_frame) * info.rx_bd_size, PROT_READ,
+                MAP_SHARED, fd, NIC_MMAP_RX_FRAME_OFFSET);
+  bds = mmap(NULL, sizeof(struct nic_bd) * info.rx_bd_size, PROT_READ,
+             MAP_SHARED, fd, NIC_MMAP_RX_BD_OFFSET);
+  if (frames == MAP_FAILED || bds == MAP_FAILED) {
+    printf("nic mmap failed\n");
+    return;
+  }
+
+  next = info.rx_next_to_use;
+  while (1) {
+    if (!(bds[next].flags & NIC_BD_FLAG_VALID)) {
+      // hand back what we have read before waiting
+      if (pending) {
+        APP_IOC_INT(fd, NIC_IOC_NR_RX_RELEASE, pending);
+        pending = 0;
       }
+      usleep(100);
+      continue;
+    }
+
+    printf("if%d rx: slot = %u, len = %u, data = %02x %02x %02x %02x\n", if_id,
+           next, bds[next].len, frames[next].data[0], frames[next].data[1],
+           frames[next].data[2], frames[next].data[3]);
+
+    next = (next + 1) % info.rx_bd_size;
+    if (++pending == APP_RX_RELEASE_BATCH) {
+      APP_IOC_INT(fd, NIC_IOC_NR_RX_RELEASE, pending);
+      pending = 0;
     }
-    printf("\n");
   }
 }
 
@@ -90,19 +147,164 @@ void send_raw(int if_id) {
   }
 
   while (1) {
-    write(fd, buf, sizeof(buf));
+    if (write(fd, buf, sizeof(buf)) < 0) {
+      printf("nic send failed\n");
+      return;
+    }
     printf("send raw: len = %zu\n", sizeof(buf));
-    break;
     usleep(100000);
   }
 }
 
+void send_mmap(int if_id, int count) {
+  struct nic_ring_info info;
+  struct nic_tx_frame *frames;
+  volatile struct nic_uio_tx_ctl *ctl;
+  uint32_t next, free_slots, burst;
+  int sent = 0;
+  int i;
+  int err;
+
+  APP_IOC_INT(fd, NIC_IOC_NR_UIO_EN, if_id);
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RW_RAW, if_id);
+  if (err) {
+    printf("nic send failed\n");
+    return;
+  }
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RING_INFO, &info);
+  if (err) {
+    printf("nic ring info failed\n");
+    return;
+  }
+
+  frames = mmap(NULL, sizeof(struct nic_tx_frame) * info.tx_bd_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                NIC_MMAP_TX_FRAME_OFFSET);
+  ctl = mmap(NULL, sizeof(struct nic_uio_tx_ctl), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, NIC_MMAP_TX_CTL_OFFSET);
+  if (frames == MAP_FAILED || ctl == MAP_FAILED) {
+    printf("nic mmap failed\n");
+    return;
+  }
+
+  while (sent < count) {
+    next = ctl->next_to_use;
+    free_slots = info.tx_bd_size - 1 -
+                 (next + info.tx_bd_size - ctl->next_to_clean) %
+                     info.tx_bd_size;
+    burst = count - sent;
+    if (burst > free_slots) {
+      burst = free_slots;
+    }
+    if (burst > APP_TX_KICK_BATCH) {
+      burst = APP_TX_KICK_BATCH;
+    }
+    if (!burst) {
+      usleep(100);
+      continue;
+    }
+
+    // fill the slots in place, then publish them with one kick
+    for (i = 0; i < burst; i++) {
+      uint32_t slot = (next + i) % info.tx_bd_size;
+      for (int j = 0; j < 64; j++) {
+        frames[slot].data[j] = (sent + i + j) & 0xff;
+      }
+      ctl->len[slot] = 64;
+    }
+    err = APP_IOC_INT(fd, NIC_IOC_NR_TX_KICK, burst);
+    if (err < 0) {
+      printf("nic kick failed\n");
+      return;
+    }
+    sent += err;
+  }
+  printf("send mmap: %d frames\n", sent);
+}
+
+void listen_burst(int if_id) {
+  static struct nic_rx_frame bufs[NIC_BURST_MAX];
+  struct nic_burst_frame frames[NIC_BURST_MAX];
+  struct nic_burst burst;
+  int i;
+  int err;
+
+  APP_IOC_INT(fd, NIC_IOC_NR_UIO_EN, if_id);
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RW_RAW, if_id);
+  if (err) {
+    printf("nic listen failed\n");
+    return;
+  }
+
+  while (1) {
+    for (i = 0; i < NIC_BURST_MAX; i++) {
+      frames[i].buf = (uint64_t)(uintptr_t)&bufs[i];
+      frames[i].len = sizeof(bufs[i]);
+    }
+    burst.frames = (uint64_t)(uintptr_t)frames;
+    burst.count = NIC_BURST_MAX;
+    err = APP_IOC_INT(fd, NIC_IOC_NR_RECV_BURST, &burst);
+    if (err < 0) {
+      printf("nic recv burst failed\n");
+      return;
+    }
+
+    printf("if%d rx burst: %u frames\n", if_id, burst.done);
+    for (i = 0; i < burst.done; i++) {
+      printf("  if%u len = %u%s\n", frames[i].if_id, frames[i].len,
+             frames[i].len > sizeof(bufs[i]) ? " (truncated)" : "");
+    }
+  }
+}
+
+void send_burst(int if_id, int count) {
+  static uint8_t buf[64];
+  struct nic_burst_frame frames[NIC_BURST_MAX];
+  struct nic_burst burst;
+  int sent = 0;
+  int i;
+  int err;
+
+  APP_IOC_INT(fd, NIC_IOC_NR_UIO_EN, if_id);
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RW_RAW, if_id);
+  if (err) {
+    printf("nic send failed\n");
+    return;
+  }
+
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = i & 0xff;
+  }
+  for (i = 0; i < NIC_BURST_MAX; i++) {
+    frames[i].buf = (uint64_t)(uintptr_t)buf;
+    frames[i].len = sizeof(buf);
+  }
+
+  while (sent < count) {
+    burst.frames = (uint64_t)(uintptr_t)frames;
+    burst.count = count - sent < NIC_BURST_MAX ? count - sent : NIC_BURST_MAX;
+    err = APP_IOC_INT(fd, NIC_IOC_NR_SEND_BURST, &burst);
+    if (err < 0) {
+      // ring full, let the device catch up
+      usleep(100);
+      continue;
+    }
+    sent += burst.done;
+  }
+  printf("send burst: %d frames\n", sent);
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     printf("Usage: %s <cmd>\n", argv[0]);
     return -1;
   }
 
+  // opens the cdev or the netdevs itself, one fd per port
+  if (strcmp(argv[1], "bench") == 0) {
+    return bench(argc, argv);
+  }
+
   fd = open("/dev/" NIC_DRIVER_NAME, O_RDWR | O_SYNC);
   if (fd < 0) {
     printf("open hw failed\n");
@@ -127,6 +329,16 @@ int main(int argc, char *argv[]) {
     printf("press ctrl+c to exit\n");
     sleep(1);
     listen(if_id);
+  } else if (strcmp(argv[1], "listen_mmap") == 0) {
+    if (argc < 3) {
+      printf("Usage: %s listen_mmap <if_id>\n", argv[0]);
+      return -1;
+    }
+    int if_id = atoi(argv[2]);
+    printf("listen_mmap if%d\n", if_id);
+    printf("press ctrl+c to exit\n");
+    sleep(1);
+    listen_mmap(if_id);
   } else if (strcmp(argv[1], "send") == 0) {
     if (argc < 3) {
       printf("Usage: %s send <if_id>\n", argv[0]);
@@ -137,6 +349,33 @@ int main(int argc, char *argv[]) {
     printf("press ctrl+c to exit\n");
     // sleep(1);
     send_raw(if_id);
+  } else if (strcmp(argv[1], "send_mmap") == 0) {
+    if (argc < 4) {
+      printf("Usage: %s send_mmap <if_id> <count>\n", argv[0]);
+      return -1;
+    }
+    int if_id = atoi(argv[2]);
+    int count = atoi(argv[3]);
+    printf("send_mmap if%d\n", if_id);
+    send_mmap(if_id, count);
+  } else if (strcmp(argv[1], "listen_burst") == 0) {
+    if (argc < 3) {
+      printf("Usage: %s listen_burst <if_id>\n", argv[0]);
+      return -1;
+    }
+    int if_id = atoi(argv[2]);
+    printf("listen_burst if%d\n", if_id);
+    printf("press ctrl+c to exit\n");
+    listen_burst(if_id);
+  } else if (strcmp(argv[1], "send_burst") == 0) {
+    if (argc < 4) {
+      printf("Usage: %s send_burst <if_id> <count>\n", argv[0]);
+      return -1;
+    }
+    int if_id = atoi(argv[2]);
+    int count = atoi(argv[3]);
+    printf("send_burst if%d\n", if_id);
+    send_burst(if_id, count);
   } else if (strcmp(argv[1], "uio_en") == 0) {
     if (argc < 3) {
       printf("Usage: %s uio_en <if_id>\n", argv[0]);
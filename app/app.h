@@ -7,4 +7,13 @@
 #define APP_IOC(fd,nr) ioctl(fd, _IOWR(NIC_IOC_MAGIC, nr, int), NULL);
 #define APP_IOC_INT(fd,nr,arg) ioctl(fd, _IOWR(NIC_IOC_MAGIC, nr, int), arg);
 
+#define APP_RX_RELEASE_BATCH 16
+
+#define APP_TX_KICK_BATCH 32
+
+// ieee local experimental, tells bench frames from other traffic
+#define APP_BENCH_ETHERTYPE 0x88b5
+
+int bench(int argc, char *argv[]);
+
 #endif
\ No newline at end of file
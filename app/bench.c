@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+
+#include "app.h"
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// pktgen style traffic from one port to the other, one pinned thread per
+// port, over the raw cdev or over af_packet sockets on the netdevs
+
+enum app_bench_mode {
+  APP_BENCH_RAW,
+  APP_BENCH_NETDEV,
+};
+
+struct app_bench_cfg {
+  enum app_bench_mode mode;
+  // if ids in raw mode, interface names in netdev mode
+  const char *tx_if;
+  const char *rx_if;
+  uint32_t frame_size;
+  uint32_t burst;
+  // 0 is as fast as the tx path takes them
+  uint64_t pps;
+  uint32_t warmup;
+  uint32_t seconds;
+  int tx_cpu;
+  int rx_cpu;
+};
+
+struct app_bench_thread {
+  struct app_bench_cfg *cfg;
+  pthread_t thread;
+  int cpu;
+  int fd;
+  // written by the thread, read by main
+  uint64_t frames;
+  uint64_t bytes;
+  // tx ring or socket buffer full
+  uint64_t busy;
+  // spent waiting for the rate, not counted as cpu per frame
+  uint64_t pace_ns;
+};
+
+// counters of one thread at one point of time
+struct app_bench_snap {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t busy;
+  uint64_t cpu_ns;
+  uint64_t pace_ns;
+};
+
+static volatile int app_bench_stop;
+
+static uint64_t app_bench_ns(clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void app_bench_pin(struct app_bench_thread *t) {
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(t->cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    printf("pin to cpu %d failed\n", t->cpu);
+  }
+}
+
+static void app_bench_frame(struct app_bench_cfg *cfg, uint8_t *buf) {
+  struct ether_header *eth = (struct ether_header *)buf;
+  uint32_t i;
+
+  memset(eth->ether_dhost, 0xff, ETH_ALEN);
+  memcpy(eth->ether_shost, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+  eth->ether_type = htons(APP_BENCH_ETHERTYPE);
+  for (i = sizeof(*eth); i < cfg->frame_size; i++) {
+    buf[i] = i & 0xff;
+  }
+}
+
+static int app_bench_is_ours(const uint8_t *buf, uint32_t len) {
+  const struct ether_header *eth = (const struct ether_header *)buf;
+
+  return len >= sizeof(*eth) && eth->ether_type == htons(APP_BENCH_ETHERTYPE);
+}
+
+// with a rate set, wait until the next burst is due
+static void app_bench_pace(struct app_bench_thread *t, uint64_t start,
+                           uint64_t sent) {
+  uint64_t due, now, begin;
+
+  if (!t->cfg->pps) {
+    return;
+  }
+  due = start + sent * 1000000000ULL / t->cfg->pps;
+  begin = now = app_bench_ns(CLOCK_MONOTONIC);
+  while (now < due && !app_bench_stop) {
+    now = app_bench_ns(CLOCK_MONOTONIC);
+  }
+  __atomic_store_n(&t->pace_ns, t->pace_ns + now - begin, __ATOMIC_RELAXED);
+}
+
+static void app_bench_count(struct app_bench_thread *t, uint64_t frames,
+                            uint64_t bytes) {
+  __atomic_store_n(&t->frames, t->frames + frames, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->bytes, t->bytes + bytes, __ATOMIC_RELAXED);
+}
+
+static void app_bench_busy(struct app_bench_thread *t) {
+  __atomic_store_n(&t->busy, t->busy + 1, __ATOMIC_RELAXED);
+}
+
+static int app_bench_raw_open(int if_id) {
+  int fd;
+  int err;
+
+  fd = open("/dev/" NIC_DRIVER_NAME, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    printf("open hw failed\n");
+    return -1;
+  }
+  err = APP_IOC_INT(fd, NIC_IOC_NR_UIO_EN, if_id);
+  if (err) {
+    printf("if%d: uio enable failed\n", if_id);
+    close(fd);
+    return -1;
+  }
+  err = APP_IOC_INT(fd, NIC_IOC_NR_RW_RAW, if_id);
+  if (err) {
+    printf("if%d: raw port busy or down\n", if_id);
+    APP_IOC_INT(fd, NIC_IOC_NR_UIO_DIS, if_id);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// closing the fd alone leaves the port with uio enabled
+static void app_bench_close(struct app_bench_cfg *cfg, int fd,
+                            const char *ifname) {
+  int err;
+
+  if (fd < 0) {
+    return;
+  }
+  if (cfg->mode == APP_BENCH_RAW) {
+    // releases the raw port too
+    err = APP_IOC_INT(fd, NIC_IOC_NR_UIO_DIS, atoi(ifname));
+    if (err) {
+      printf("if%s: uio disable failed\n", ifname);
+    }
+  }
+  close(fd);
+}
+
+static void app_bench_sigint(int sig) { app_bench_stop = 1; }
+
+static void *app_bench_raw_tx(void *arg) {
+  struct app_bench_thread *t = arg;
+  struct app_bench_cfg *cfg = t->cfg;
+  static uint8_t bufs[NIC_BURST_MAX][NIC_TX_PKT_SIZE];
+  struct nic_burst_frame frames[NIC_BURST_MAX];
+  struct nic_burst burst;
+  uint64_t start, sent = 0;
+  uint32_t i;
+  int done;
+
+  app_bench_pin(t);
+  for (i = 0; i < cfg->burst; i++) {
+    app_bench_frame(cfg, bufs[i]);
+    frames[i].buf = (uint64_t)(uintptr_t)bufs[i];
+    frames[i].len = cfg->frame_size;
+  }
+
+  start = app_bench_ns(CLOCK_MONOTONIC);
+  while (!app_bench_stop) {
+    app_bench_pace(t, start, sent);
+    burst.frames = (uint64_t)(uintptr_t)frames;
+    burst.count = cfg->burst;
+    done = ioctl(t->fd, _IOWR(NIC_IOC_MAGIC, NIC_IOC_NR_SEND_BURST, int),
+                 &burst);
+    if (done < 0) {
+      if (errno != EAGAIN) {
+        printf("nic send burst failed\n");
+        break;
+      }
+      app_bench_busy(t);
+      continue;
+    }
+    sent += done;
+    app_bench_count(t, done, (uint64_t)done * cfg->frame_size);
+  }
+  return NULL;
+}
+
+static void *app_bench_raw_rx(void *arg) {
+  struct app_bench_thread *t = arg;
+  static struct nic_rx_frame bufs[NIC_BURST_MAX];
+  struct nic_burst_frame frames[NIC_BURST_MAX];
+  struct pollfd pfd = {.fd = t->fd, .events = POLLIN};
+  struct nic_burst burst;
+  uint64_t n, bytes;
+  int done;
+  int i;
+
+  app_bench_pin(t);
+  for (i = 0; i < NIC_BURST_MAX; i++) {
+    frames[i].buf = (uint64_t)(uintptr_t)&bufs[i];
+  }
+
+  while (!app_bench_stop) {
+    for (i = 0; i < NIC_BURST_MAX; i++) {
+      frames[i].len = sizeof(bufs[i]);
+    }
+    burst.frames = (uint64_t)(uintptr_t)frames;
+    burst.count = NIC_BURST_MAX;
+    done = ioctl(t->fd, _IOWR(NIC_IOC_MAGIC, NIC_IOC_NR_RECV_BURST, int),
+                 &burst);
+    if (done < 0) {
+      if (errno != EAGAIN) {
+        printf("nic recv burst failed\n");
+        break;
+      }
+      // the timeout lets the thread see app_bench_stop
+      poll(&pfd, 1, 100);
+      continue;
+    }
+    for (i = 0, n = 0, bytes = 0; i < done; i++) {
+      // longer than the buffer, the frame was truncated
+      if (frames[i].len > sizeof(bufs[i])) {
+        continue;
+      }
+      if (app_bench_is_ours(bufs[i].data, frames[i].len)) {
+        n++;
+        bytes += frames[i].len;
+      }
+    }
+    app_bench_count(t, n, bytes);
+  }
+  return NULL;
+}
+
+static int app_bench_sock(const char *ifname, uint16_t proto) {
+  struct sockaddr_ll addr = {0};
+  int rcvbuf = 16 << 20;
+  int fd;
+
+  fd = socket(AF_PACKET, SOCK_RAW, htons(proto));
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(proto);
+  addr.sll_ifindex = if_nametoindex(ifname);
+  if (!addr.sll_ifindex ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    printf("%s: bind failed\n", ifname);
+    close(fd);
+    return -1;
+  }
+  // a short stall of the reader should not show up as drops
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  return fd;
+}
+
+static void *app_bench_sock_tx(void *arg) {
+  struct app_bench_thread *t = arg;
+  struct app_bench_cfg *cfg = t->cfg;
+  static uint8_t bufs[NIC_BURST_MAX][NIC_TX_PKT_SIZE];
+  struct mmsghdr msgs[NIC_BURST_MAX];
+  struct iovec iovs[NIC_BURST_MAX];
+  uint64_t start, sent = 0;
+  uint32_t i;
+  int done;
+
+  app_bench_pin(t);
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < cfg->burst; i++) {
+    app_bench_frame(cfg, bufs[i]);
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = cfg->frame_size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  start = app_bench_ns(CLOCK_MONOTONIC);
+  while (!app_bench_stop) {
+    app_bench_pace(t, start, sent);
+    done = sendmmsg(t->fd, msgs, cfg->burst, MSG_DONTWAIT);
+    if (done < 0) {
+      if (errno != EAGAIN && errno != ENOBUFS) {
+        perror("sendmmsg");
+        break;
+      }
+      app_bench_busy(t);
+      continue;
+    }
+    sent += done;
+    app_bench_count(t, done, (uint64_t)done * cfg->frame_size);
+  }
+  return NULL;
+}
+
+static void *app_bench_sock_rx(void *arg) {
+  struct app_bench_thread *t = arg;
+  static uint8_t bufs[NIC_BURST_MAX][NIC_RX_PKT_SIZE];
+  struct mmsghdr msgs[NIC_BURST_MAX];
+  struct iovec iovs[NIC_BURST_MAX];
+  struct pollfd pfd = {.fd = t->fd, .events = POLLIN};
+  uint64_t bytes;
+  int done;
+  int i;
+
+  app_bench_pin(t);
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < NIC_BURST_MAX; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = sizeof(bufs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (!app_bench_stop) {
+    done = recvmmsg(t->fd, msgs, NIC_BURST_MAX, MSG_DONTWAIT, NULL);
+    if (done < 0) {
+      if (errno != EAGAIN) {
+        perror("recvmmsg");
+        break;
+      }
+      poll(&pfd, 1, 100);
+      continue;
+    }
+    for (i = 0, bytes = 0; i < done; i++) {
+      bytes += msgs[i].msg_len;
+    }
+    app_bench_count(t, done, bytes);
+  }
+  return NULL;
+}
+
+// frames the rx side lost below the thread, cumulative
+static uint64_t app_bench_rx_drops(struct app_bench_thread *t,
+                                   enum app_bench_mode mode) {
+  static uint64_t sock_drops;
+  struct tpacket_stats stats;
+  socklen_t len = sizeof(stats);
+  struct nic_ring_info info;
+  int err;
+
+  if (mode == APP_BENCH_RAW) {
+    err = APP_IOC_INT(t->fd, NIC_IOC_NR_RING_INFO, &info);
+    return err ? 0 : info.rx_drops;
+  }
+  // the socket counters reset on every read
+  if (!getsockopt(t->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len)) {
+    sock_drops += stats.tp_drops;
+  }
+  return sock_drops;
+}
+
+static void app_bench_snap(struct app_bench_thread *t,
+                           struct app_bench_snap *snap) {
+  clockid_t clock;
+
+  snap->frames = __atomic_load_n(&t->frames, __ATOMIC_RELAXED);
+  snap->bytes = __atomic_load_n(&t->bytes, __ATOMIC_RELAXED);
+  snap->busy = __atomic_load_n(&t->busy, __ATOMIC_RELAXED);
+  snap->pace_ns = __atomic_load_n(&t->pace_ns, __ATOMIC_RELAXED);
+  // the thread's user and syscall time, not the softirq work it causes
+  snap->cpu_ns = pthread_getcpuclockid(t->thread, &clock)
+                     ? 0
+                     : app_bench_ns(clock);
+}
+
+// busy jiffies of all cpus, in ns
+static uint64_t app_bench_sys_ns(void) {
+  unsigned long long user, nice, sys, idle, iowait, irq, softirq;
+  FILE *f;
+  int n;
+
+  f = fopen("/proc/stat", "r");
+  if (!f) {
+    return 0;
+  }
+  n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &sys,
+             &idle, &iowait, &irq, &softirq);
+  fclose(f);
+  if (n != 7) {
+    return 0;
+  }
+  return (user + nice + sys + irq + softirq) * 1000000000ULL /
+         sysconf(_SC_CLK_TCK);
+}
+
+// cpu time per frame, less the time spent waiting for the rate
+static double app_bench_cpu(uint64_t cpu_ns, uint64_t pace_ns,
+                            uint64_t frames) {
+  if (!frames || cpu_ns < pace_ns) {
+    return 0.0;
+  }
+  return (double)(cpu_ns - pace_ns) / frames;
+}
+
+static void app_bench_print(const char *dir, struct app_bench_snap *a,
+                            struct app_bench_snap *b, uint64_t ns) {
+  uint64_t frames = b->frames - a->frames;
+
+  printf("%s: %lu frames, %.3f Mpps, %.3f Gb/s, %.0f ns cpu/frame", dir,
+         frames, frames * 1e3 / ns, (b->bytes - a->bytes) * 8.0 / ns,
+         app_bench_cpu(b->cpu_ns - a->cpu_ns, b->pace_ns - a->pace_ns,
+                       frames));
+}
+
+static void app_bench_usage(const char *prog) {
+  printf("Usage: %s bench raw <tx if_id> <rx if_id> [options]\n", prog);
+  printf("       %s bench netdev <tx ifname> <rx ifname> [options]\n", prog);
+  printf("  -s <frame size>  bytes without fcs, default 64\n");
+  printf("  -b <burst>       frames per send call, 1..%d, default 32\n",
+         NIC_BURST_MAX);
+  printf("  -r <pps>         tx rate, default 0 for as fast as possible\n");
+  printf("  -w <seconds>     warmup before measuring, default 1\n");
+  printf("  -t <seconds>     measured interval, default 10\n");
+  printf("  -c <cpu>         cpu of the tx thread, default 0\n");
+  printf("  -C <cpu>         cpu of the rx thread, default 1\n");
+}
+
+int bench(int argc, char *argv[]) {
+  struct app_bench_cfg cfg = {
+      .frame_size = 64,
+      .burst = 32,
+      .warmup = 1,
+      .seconds = 10,
+      .tx_cpu = 0,
+      .rx_cpu = 1,
+  };
+  struct app_bench_thread tx = {0}, rx = {0};
+  struct app_bench_snap tx0, tx1, rx0, rx1;
+  uint64_t start, ns, sys0, sys1, drops0, drops1, lost;
+  void *(*tx_fn)(void *), *(*rx_fn)(void *);
+  struct sigaction sa = {.sa_handler = app_bench_sigint};
+  int opt;
+
+  if (argc < 5) {
+    app_bench_usage(argv[0]);
+    return -1;
+  }
+  if (strcmp(argv[2], "raw") == 0) {
+    cfg.mode = APP_BENCH_RAW;
+  } else if (strcmp(argv[2], "netdev") == 0) {
+    cfg.mode = APP_BENCH_NETDEV;
+  } else {
+    app_bench_usage(argv[0]);
+    return -1;
+  }
+  cfg.tx_if = argv[3];
+  cfg.rx_if = argv[4];
+
+  optind = 5;
+  while ((opt = getopt(argc, argv, "s:b:r:w:t:c:C:")) != -1) {
+    switch (opt) {
+    case 's':
+      cfg.frame_size = atoi(optarg);
+      break;
+    case 'b':
+      cfg.burst = atoi(optarg);
+      break;
+    case 'r':
+      cfg.pps = strtoull(optarg, NULL, 0);
+      break;
+    case 'w':
+      cfg.warmup = atoi(optarg);
+      break;
+    case 't':
+      cfg.seconds = atoi(optarg);
+      break;
+    case 'c':
+      cfg.tx_cpu = atoi(optarg);
+      break;
+    case 'C':
+      cfg.rx_cpu = atoi(optarg);
+      break;
+    default:
+      app_bench_usage(argv[0]);
+      return -1;
+    }
+  }
+  if (cfg.frame_size < ETH_ZLEN || cfg.frame_size > NIC_TX_PKT_SIZE ||
+      !cfg.burst || cfg.burst > NIC_BURST_MAX || !cfg.seconds) {
+    app_bench_usage(argv[0]);
+    return -1;
+  }
+
+  // ends the run early, the ports are still handed back
+  sigaction(SIGINT, &sa, NULL);
+
+  if (cfg.mode == APP_BENCH_RAW) {
+    if (atoi(cfg.tx_if) == atoi(cfg.rx_if)) {
+      printf("raw mode needs two ports, the raw port is exclusive\n");
+      return -1;
+    }
+    tx.fd = app_bench_raw_open(atoi(cfg.tx_if));
+    rx.fd = app_bench_raw_open(atoi(cfg.rx_if));
+    tx_fn = app_bench_raw_tx;
+    rx_fn = app_bench_raw_rx;
+  } else {
+    // protocol 0, the tx socket sees no rx traffic
+    tx.fd = app_bench_sock(cfg.tx_if, 0);
+    rx.fd = app_bench_sock(cfg.rx_if, APP_BENCH_ETHERTYPE);
+    tx_fn = app_bench_sock_tx;
+    rx_fn = app_bench_sock_rx;
+  }
+  if (tx.fd < 0 || rx.fd < 0) {
+    goto err_fd;
+  }
+
+  tx.cfg = &cfg;
+  tx.cpu = cfg.tx_cpu;
+  rx.cfg = &cfg;
+  rx.cpu = cfg.rx_cpu;
+  if (pthread_create(&rx.thread, NULL, rx_fn, &rx)) {
+    printf("create rx thread failed\n");
+    goto err_fd;
+  }
+  if (pthread_create(&tx.thread, NULL, tx_fn, &tx)) {
+    printf("create tx thread failed\n");
+    goto err_tx;
+  }
+
+  printf("bench %s %s -> %s, %u B frames, burst %u, rate %lu pps\n", argv[2],
+         cfg.tx_if, cfg.rx_if, cfg.frame_size, cfg.burst, cfg.pps);
+  if (!app_bench_stop) {
+    sleep(cfg.warmup);
+  }
+
+  // steady state between two snapshots
+  app_bench_snap(&tx, &tx0);
+  app_bench_snap(&rx, &rx0);
+  drops0 = app_bench_rx_drops(&rx, cfg.mode);
+  sys0 = app_bench_sys_ns();
+  start = app_bench_ns(CLOCK_MONOTONIC);
+  if (!app_bench_stop) {
+    sleep(cfg.seconds);
+  }
+  app_bench_snap(&tx, &tx1);
+  app_bench_snap(&rx, &rx1);
+  drops1 = app_bench_rx_drops(&rx, cfg.mode);
+  sys1 = app_bench_sys_ns();
+  ns = app_bench_ns(CLOCK_MONOTONIC) - start;
+
+  app_bench_stop = 1;
+  pthread_join(tx.thread, NULL);
+  pthread_join(rx.thread, NULL);
+
+  app_bench_print("tx", &tx0, &tx1, ns);
+  printf(", %lu busy\n", tx1.busy - tx0.busy);
+  app_bench_print("rx", &rx0, &rx1, ns);
+  printf("\n");
+  // frames in flight at the snapshots make this off by up to a ring
+  lost = tx1.frames - tx0.frames > rx1.frames - rx0.frames
+             ? (tx1.frames - tx0.frames) - (rx1.frames - rx0.frames)
+             : 0;
+  printf("drops: %lu lost, %lu at the rx %s\n", lost, drops1 - drops0,
+         cfg.mode == APP_BENCH_RAW ? "queue" : "socket");
+  printf("system: %.0f ns cpu/frame received\n",
+         app_bench_cpu(sys1 - sys0, tx1.pace_ns - tx0.pace_ns,
+                       rx1.frames - rx0.frames));
+
+  app_bench_close(&cfg, tx.fd, cfg.tx_if);
+  app_bench_close(&cfg, rx.fd, cfg.rx_if);
+  return 0;
+
+err_tx:
+  app_bench_stop = 1;
+  pthread_join(rx.thread, NULL);
+err_fd:
+  app_bench_close(&cfg, tx.fd, cfg.tx_if);
+  app_bench_close(&cfg, rx.fd, cfg.rx_if);
+  return -1;
+}
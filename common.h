@@ -18,10 +18,18 @@ typedef uint64_t dma_addr_t;
 
 #define NIC_RX_PKT_SIZE 2048
 
+#define NIC_TX_PKT_SIZE 2048
+
+// ring sizes of the device, it has no size register and indexes its rings
+// as if they had this many entries. NIC_*_RING_MAX bound the driver side
 #define NIC_TX_RING_QUEUES 256
 
 #define NIC_RX_RING_QUEUES 256
 
+#define NIC_TX_RING_MAX 1024
+
+#define NIC_RX_RING_MAX 1024
+
 #define NIC_IOC_MAGIC 'S'
 
 #define NIC_IOC_NR_SET_HW 1
@@ -34,10 +42,44 @@ typedef uint64_t dma_addr_t;
 
 #define NIC_IOC_NR_UIO_DIS 5
 
+#define NIC_IOC_NR_RX_RELEASE 6
+
+#define NIC_IOC_NR_RING_INFO 7
+
+#define NIC_IOC_NR_TX_KICK 8
+
+#define NIC_IOC_NR_RECV_BURST 9
+
+#define NIC_IOC_NR_SEND_BURST 10
+
+#define NIC_BURST_MAX 64
+
+// cmd_op of IORING_OP_URING_CMD, from linux 6.7 on. older kernels fail
+// the cmd with -EOPNOTSUPP, use the burst ioctls and poll there
+
+#define NIC_URING_CMD_RECV 1
+
+#define NIC_URING_CMD_SEND 2
+
+// mmap offsets, select the region of the raw port to map
+
+#define NIC_MMAP_RX_FRAME_OFFSET 0x0000000
+
+#define NIC_MMAP_RX_BD_OFFSET 0x1000000
+
+#define NIC_MMAP_TX_FRAME_OFFSET 0x2000000
+
+#define NIC_MMAP_TX_CTL_OFFSET 0x3000000
+
 #define CHECK_IF_NR(nr) (arg < 0 || arg >= NIC_IF_NUM)
 
 typedef uint16_t frame_len_t;
 
+#define NIC_BD_FLAG_VALID (1ULL << 63)
+
+// tx, last descriptor of a frame, frames may span several descriptors
+#define NIC_BD_FLAG_EOP (1ULL << 62)
+
 struct nic_bd {
   union {
     uint64_t flags;
@@ -50,4 +92,50 @@ struct nic_rx_frame {
   uint8_t data[NIC_RX_PKT_SIZE];
 };
 
+struct nic_tx_frame {
+  uint8_t data[NIC_TX_PKT_SIZE];
+};
+
+// mapped at NIC_MMAP_TX_CTL_OFFSET, slot i pairs with tx frame i
+struct nic_uio_tx_ctl {
+  // written by the driver
+  uint32_t next_to_use;
+  uint32_t next_to_clean;
+  // written by userspace before NIC_IOC_NR_TX_KICK
+  frame_len_t len[NIC_TX_RING_MAX];
+};
+
+// one frame of NIC_IOC_NR_RECV_BURST/NIC_IOC_NR_SEND_BURST
+struct nic_burst_frame {
+  uint64_t buf;
+  // buffer size in, frame length out on receive. a length above the
+  // buffer size means the frame was truncated to the buffer
+  frame_len_t len;
+  uint16_t if_id;
+  uint32_t reserved;
+};
+
+struct nic_burst {
+  uint64_t frames;
+  uint32_t count;
+  uint32_t done;
+};
+
+// payload of IORING_OP_URING_CMD, fits the sqe cmd area,
+// the cqe res is the number of frames moved
+struct nic_uring_cmd {
+  uint64_t frames;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct nic_ring_info {
+  uint32_t rx_bd_size;
+  uint32_t rx_next_to_use;
+  uint32_t tx_bd_size;
+  uint32_t tx_next_to_use;
+  // frames dropped while the reader fell behind
+  uint64_t rx_drops;
+};
+
 #endif
\ No newline at end of file
@@ -2,17 +2,23 @@
 #define _NIC_H_
 
 #include <linux/cdev.h>
+#include <linux/dim.h>
 #include <linux/etherdevice.h>
 #include <linux/ethtool.h>
+#include <linux/hrtimer.h>
+#include <linux/if_vlan.h>
 #include <linux/init.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/netdevice.h>
 #include <linux/pci.h>
 #include <linux/spinlock_types.h>
 #include <linux/stddef.h>
 #include <linux/types.h>
+#include <linux/u64_stats_sync.h>
+#include <net/xdp.h>
 
 #include "common.h"
 
@@ -25,19 +31,68 @@
 #define NO_INT
 
 #ifdef NO_INT
-#define NIC_EMU_INT_JIFFIES (HZ / 100)
+// bounds of the adaptive emulated interrupt interval, see nic_hw.c
+#define NIC_EMU_INT_MIN_US 20
+#define NIC_EMU_INT_MAX_US 10000
+// NIC_VEC_TX, NIC_VEC_RX
+#define NIC_EMU_INT_VECS 2
 #endif
 
-#define NIC_UIO_RX_TIMEOUT_JIFFIES (HZ / 10)
+// segments per tso skb, each takes a header and at least one payload
+// descriptor, the stack splits larger ones
+#define NIC_TSO_MAX_SEGS 8
 
+// descriptors a single skb may take, xmit stops the queue below this
+#define NIC_TX_DESC_NEEDED (2 * NIC_TSO_MAX_SEGS + MAX_SKB_FRAGS)
+
+// free descriptors before tx cleaning wakes a stopped queue, has to stay
+// below NIC_RING_MIN
+#define NIC_TX_WAKE_THRESHOLD NIC_TX_DESC_NEEDED
+
+// defaults of tx-frames and rx-frames-irq, see nic_ethtool.c
 #define NIC_TX_SYNC_THRESHOLD 4
 
 #define NIC_RX_SYNC_NUM 4
 
-#define NIC_RX_SYNC_THRESHOLD (NIC_RX_SYNC_NUM / 2)
+// page pool buffers leave room for xdp and the skb head
+#define NIC_RX_HEADROOM (XDP_PACKET_HEADROOM + NET_IP_ALIGN)
+
+// frames that fit a single NIC_RX_PKT_SIZE rx buffer
+#define NIC_BUF_MAX_MTU (NIC_RX_PKT_SIZE - VLAN_ETH_HLEN)
+
+// jumbo frames span several rx buffers, only with the hw_eop parameter
+#define NIC_MAX_MTU 9000
+
+// xdp runs on a single rx buffer
+#define NIC_XDP_MAX_MTU NIC_BUF_MAX_MTU
 
 #endif
 
+// power of two
+#define NIC_UIO_RXQ_SIZE 128
+
+// ring sizes are powers of two, indexes wrap with a mask
+#define NIC_RING_MIN 64
+#define NIC_RING_WRAP(ring, i) ((i) & ((ring)->bd_size - 1))
+
+// ring pairs per port, see the num_queues module parameter
+#define NIC_MAX_QUEUES 8
+
+// the raw cdev owns the first ring pair of a port
+#define NIC_UIO_QUEUE 0
+
+// upper bound of rx-usecs
+#define NIC_RX_USECS_MAX 1000
+
+// upper bound of tx-usecs
+#define NIC_TX_USECS_MAX 1000
+
+// software rss, ethtool -X entries are cpu ids
+#define NIC_RSS_KEY_SIZE 40
+#define NIC_RSS_INDIR_SIZE 128
+// frames a cpu context holds before steering drops
+#define NIC_RSS_BACKLOG 1000
+
 #define PCI_VENDOR_ID_MY 0x0813
 
 #define PRINT_INFO(fmt, ...)                                                   \
@@ -49,14 +104,35 @@
 #define PRINT_WARN(fmt, ...)                                                   \
   printk(KERN_WARNING NIC_DRIVER_NAME ": " fmt, ##__VA_ARGS__)
 
+// one per tx descriptor, the skb sits on the eop slot
+struct nic_tx_buffer {
+  struct sk_buff *skb;
+  // XDP_TX and ndo_xdp_xmit frames, returned on completion
+  struct xdp_frame *xdpf;
+  dma_addr_t dma;
+  // 0 when nothing is mapped, uio frames live in uio_data_va
+  u32 len;
+  // frags are pages, the head is mapped with dma_map_single
+  bool page;
+  // af_xdp umem frame, completed through xsk_tx_completed
+  bool xsk;
+};
+
 struct nic_tx_ring {
-  union {
-    struct sk_buff **skbs;
-    void **data_vas;
-  };
+  struct nic_tx_buffer *buffers;
   struct nic_bd *bd_va;
   dma_addr_t bd_pa;
 
+  // tso headers and bounced small frames, TSO_HEADER_SIZE per descriptor,
+  // coherent
+  char *tso_hdrs;
+  dma_addr_t tso_hdrs_pa;
+
+  // preallocated frames for the raw cdev path
+  struct nic_tx_frame *uio_data_va;
+  dma_addr_t uio_data_pa;
+  struct nic_uio_tx_ctl *uio_ctl;
+
   u16 bd_size;
   u16 bd_dma_size;
 
@@ -67,6 +143,13 @@ struct nic_tx_ring {
 
 struct nic_rx_ring {
   void **data_vas;
+  void *data_va;
+  dma_addr_t data_pa;
+  // slots backed by a pool page instead of the coherent frame
+  struct page **pages;
+  struct page_pool *page_pool;
+  // slots backed by a umem buffer, zero copy queues only
+  struct xdp_buff **xsk_bufs;
   struct nic_bd *bd_va;
   dma_addr_t bd_pa;
 
@@ -75,44 +158,179 @@ struct nic_rx_ring {
 
   u16 next_to_use;
   u16 last_sync;
+  // uio frames are released behind next_to_use
+  u16 next_to_clean;
 };
 
-struct nic_adapter {
-  /* OS defined structs */
-  struct net_device *netdev;
-  struct pci_dev *pdev;
+#ifdef NO_INT
+// one shot timer per vector, armed when the vector is unmasked
+struct nic_emu_int {
+  struct hrtimer timer;
+  struct nic_queue *queue;
+  int nr;
+  bool enabled;
+  bool stopped;
+  u64 interval_ns;
+  // ring position at the last unmask, the delta is the work of the last poll
+  u16 last_pos;
+};
+#endif
 
-  int msg_enable;
+// per cpu counters of a ring pair, read by nic_queue_stats_read
+struct nic_queue_stats {
+  u64_stats_t tx_packets;
+  u64_stats_t tx_bytes;
+  u64_stats_t tx_dropped;
+  u64_stats_t tx_doorbells;
+  u64_stats_t tx_ring_full;
+  u64_stats_t tx_irqs;
+  u64_stats_t rx_packets;
+  u64_stats_t rx_bytes;
+  u64_stats_t rx_dropped;
+  u64_stats_t rx_doorbells;
+  u64_stats_t rx_irqs;
+  u64_stats_t poll_exhausted;
+  u64_stats_t xdp_drop;
+  u64_stats_t xdp_tx;
+  u64_stats_t xdp_redirect;
+  u64_stats_t uio_tx_bad_len;
+  // raw frames cut to the receive buffer
+  u64_stats_t uio_rx_truncated;
+  // last, the counters before it are read as an array
+  struct u64_stats_sync syncp;
+};
+
+#define NIC_QUEUE_STATS_LEN                                                    \
+  (offsetof(struct nic_queue_stats, syncp) / sizeof(u64_stats_t))
+
+#define NIC_QUEUE_STAT_IDX(m)                                                  \
+  (offsetof(struct nic_queue_stats, m) / sizeof(u64_stats_t))
+
+// this cpu's counter, usable from any context
+#define NIC_STATS_ADD(queue, m, val)                                           \
+  do {                                                                         \
+    struct nic_queue_stats *__stats = get_cpu_ptr((queue)->stats);             \
+    unsigned long __flags = u64_stats_update_begin_irqsave(&__stats->syncp);   \
+    u64_stats_add(&__stats->m, (val));                                         \
+    u64_stats_update_end_irqrestore(&__stats->syncp, __flags);                 \
+    put_cpu_ptr((queue)->stats);                                               \
+  } while (0)
+
+#define NIC_STATS_INC(queue, m) NIC_STATS_ADD(queue, m, 1)
+
+// per cpu receive context of a port, fed by nic_poll of every queue
+struct nic_rss_ctx {
+  struct napi_struct napi;
+  // frames steered to this cpu, in arrival order
+  struct sk_buff_head backlog;
+  // schedules napi on the owning cpu
+  call_single_data_t csd;
+};
+
+// one tx/rx ring pair with its own channel registers and vectors
+struct nic_queue {
+  struct nic_adapter *adapter;
+  u16 id;
+
+  // registers of channel id * NIC_IF_NUM + if_id
+  void *io_addr;
 
   /* TX */
   struct nic_tx_ring tx_ring;
+  // rings the doorbell of a partial batch after tx_coalesce_usecs
+  struct hrtimer tx_flush_timer;
 
   /* RX */
   struct nic_rx_ring rx_ring;
   struct napi_struct napi;
+  // frame whose last buffer has not arrived yet
+  struct sk_buff *rx_skb;
+  // skip buffers up to the next eop after a drop
+  bool rx_discard;
+  struct xdp_rxq_info xdp_rxq;
+  // af_xdp zero copy, set through ndo_bpf while the queue is reset
+  struct xsk_buff_pool *xsk_pool;
+
+  int irq_tx;
+  int irq_rx;
+
+  // rx moderation, keeps the rx vector masked for rx_usecs after napi
+  struct hrtimer rx_mod_timer;
+  u32 rx_usecs;
+  struct dim rx_dim;
+  u16 rx_dim_events;
+  u64 rx_dim_packets;
+  u64 rx_dim_bytes;
+
+  // rx of the raw cdev queue, queued from the rx interrupt
+  struct work_struct uio_poll_work;
+
+  struct nic_queue_stats __percpu *stats;
+
+#ifdef NO_INT
+  // emulated interrupt
+  struct nic_emu_int emu_int[NIC_EMU_INT_VECS];
+#endif
+};
+
+struct nic_adapter {
+  /* OS defined structs */
+  struct net_device *netdev;
+  struct pci_dev *pdev;
+
+  int msg_enable;
+
+  struct nic_queue queues[NIC_MAX_QUEUES];
+  u16 num_queues;
+  // run by nic_poll on every rx buffer before an skb is built
+  struct bpf_prog *xdp_prog;
+  // NETIF_F_RXHASH spreads received frames over these by flow
+  struct nic_rss_ctx __percpu *rss;
+  u32 rss_indir[NIC_RSS_INDIR_SIZE];
+  u8 rss_key[NIC_RSS_KEY_SIZE];
+  // ethtool -G, applied by nic_resize_rings
+  u16 tx_ring_size;
+  u16 rx_ring_size;
 
   u16 if_id;
 
+  // ethtool -C
+  u32 rx_coalesce_usecs;
+  u32 rx_max_frames;
+  bool rx_adaptive;
+  // tx descriptors per doorbell and the longest a partial batch waits
+  u32 tx_max_frames;
+  u32 tx_coalesce_usecs;
+  // rx descriptors handed back per tail write
+  u16 rx_sync_num;
+
   int bars;
 
   void *io_addr;
   unsigned long io_base;
   u64 io_size;
-  int irq_tx;
-  int irq_rx;
-
-#ifdef NO_INT
-  // emulated interrupt
-  bool emu_int_rx_enabled;
-  bool emu_int_tx_enabled;
-#endif
 
   // uio
   bool uio_enabled;
   struct semaphore raw_sema;
-  struct semaphore raw_rx_sema;
-  struct semaphore raw_rx_wait_sema;
-  struct nic_uio_rx_buf *uio_rx_buf;
+  // queue of the raw port owner, filled by nic_uio_poll_work
+  struct nic_uio_rxq __rcu *uio_rxq;
+  // protects rx_ring.next_to_clean and the rx tail
+  spinlock_t uio_rx_lock;
+  u64 uio_rx_drops;
+  // woken when tx cleaning frees slots
+  wait_queue_head_t uio_tx_wait;
+  // one producer of the raw cdev tx ring at a time, write, the burst
+  // ioctl, the mmap kick and io_uring may run concurrently
+  struct mutex uio_tx_lock;
+  // pending io_uring cmds of the raw port owner
+  struct list_head uio_uring_rx;
+  struct list_head uio_uring_tx;
+  spinlock_t uio_uring_lock;
+  // rx frames mapped by userspace, consumed through nic_uio_release_rx
+  atomic_t uio_rx_mmaps;
+  // any mapping of the raw cdev queue, the rings stay put while mapped
+  atomic_t uio_mmaps;
 };
 
 #ifdef NO_PCI
@@ -125,16 +343,6 @@ struct test_work_ctx {
 
 #endif
 
-struct clean_work_ctx {
-  struct work_struct work;
-  struct nic_adapter *adapter;
-};
-
-struct uio_poll_work_ctx {
-  struct work_struct work;
-  struct nic_adapter *adapter;
-};
-
 struct nic_drvdata {
   struct cdev c_dev;
   dev_t c_dev_no;
@@ -142,19 +350,59 @@ struct nic_drvdata {
   struct net_device *netdevs[NIC_IF_NUM];
 };
 
-struct nic_uio_rx_buf {
-  void *buf;
+struct nic_uio_rxq_entry {
+  u16 slot;
   frame_len_t len;
 };
 
+// single producer (poll work), single consumer (raw port reader, the
+// lock of its nic_cdev_data serializes read, ioctl and io_uring)
+struct nic_uio_rxq {
+  struct nic_uio_rxq_entry entries[NIC_UIO_RXQ_SIZE];
+  u32 head;
+  u32 tail;
+  u64 drops;
+  wait_queue_head_t wait;
+};
+
 struct nic_uio_tx_buf {
   const char __user *buf;
   frame_len_t len;
 };
 
-void nic_uio_xmit_frame(struct nic_adapter *adapter,
-                        struct nic_uio_tx_buf *uio_tx_buf);
+int nic_uio_xmit_frame(struct nic_adapter *adapter,
+                       struct nic_uio_tx_buf *uio_tx_buf);
+
+int nic_uio_kick_tx(struct nic_adapter *adapter, u16 count);
+
+u16 nic_uio_tx_free(struct nic_tx_ring *tx_ring);
+
+bool nic_uio_rx_pending(struct nic_adapter *adapter, struct nic_uio_rxq *rxq);
+
+int nic_uio_xmit_burst(struct nic_adapter *adapter,
+                       struct nic_burst_frame *frames, u16 count);
+
+int nic_uio_recv_burst(struct nic_adapter *adapter, struct nic_uio_rxq *rxq,
+                       struct nic_burst_frame *frames, u16 count);
+
+int nic_uio_enable(struct nic_adapter *adapter);
+
+int nic_uio_disable(struct nic_adapter *adapter);
+
+void nic_uio_attach_rxq(struct nic_adapter *adapter, struct nic_uio_rxq *rxq);
+
+void nic_uio_detach_rxq(struct nic_adapter *adapter, struct nic_uio_rxq *rxq);
+
+int nic_uio_release_rx(struct nic_adapter *adapter, u16 count);
+
+void nic_uio_rearm_rx(struct nic_adapter *adapter);
 
 void nic_set_ethtool_ops(struct net_device *netdev);
 
+void nic_set_rx_usecs(struct nic_adapter *adapter, u32 usecs);
+
+int nic_resize_rings(struct nic_adapter *adapter, u16 tx_size, u16 rx_size);
+
+void nic_queue_stats_read(struct nic_queue *queue, u64 *data);
+
 #endif
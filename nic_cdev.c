@@ -2,8 +2,11 @@
 #include "common.h"
 #include "nic.h"
 #include "nic_hw.h"
+#include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/semaphore.h>
+#include <linux/version.h>
 
 int nic_cdev_open(struct inode *inode, struct file *filp);
 int nic_cdev_release(struct inode *inode, struct file *filp);
@@ -13,6 +16,13 @@ ssize_t nic_cdev_write(struct file *filp, const char __user *buf, size_t count,
                        loff_t *f_pos);
 long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 loff_t nic_cdev_llseek(struct file *filp, loff_t off, int whence);
+int nic_cdev_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t nic_cdev_poll(struct file *filp, struct poll_table_struct *wait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+int nic_cdev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+static void nic_cdev_uring_cancel(struct nic_cdev_data *cdev_data,
+                                  struct nic_adapter *adapter);
+#endif
 
 struct file_operations nic_fops = {
     .owner = THIS_MODULE,
@@ -22,6 +32,51 @@ struct file_operations nic_fops = {
     .write = nic_cdev_write,
     .unlocked_ioctl = nic_cdev_ioctl,
     .llseek = nic_cdev_llseek,
+    .mmap = nic_cdev_mmap,
+    .poll = nic_cdev_poll,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    // a parked cmd can only be cancelled on ring teardown from 6.7 on
+    .uring_cmd = nic_cdev_uring_cmd,
+#endif
+};
+
+static void nic_cdev_vma_open(struct vm_area_struct *vma) {
+  struct nic_adapter *adapter = vma->vm_private_data;
+  struct nic_cdev_data *cdev_data = vma->vm_file->private_data;
+  atomic_inc(&adapter->uio_mmaps);
+  atomic_inc(&cdev_data->mmaps);
+}
+
+static void nic_cdev_vma_close(struct vm_area_struct *vma) {
+  struct nic_adapter *adapter = vma->vm_private_data;
+  struct nic_cdev_data *cdev_data = vma->vm_file->private_data;
+  atomic_dec(&cdev_data->mmaps);
+  atomic_dec(&adapter->uio_mmaps);
+}
+
+static void nic_cdev_rx_vma_open(struct vm_area_struct *vma) {
+  struct nic_adapter *adapter = vma->vm_private_data;
+  atomic_inc(&adapter->uio_rx_mmaps);
+  nic_cdev_vma_open(vma);
+}
+
+static void nic_cdev_rx_vma_close(struct vm_area_struct *vma) {
+  struct nic_adapter *adapter = vma->vm_private_data;
+  // the poll work copies frames again, it may have left the vector masked
+  if (atomic_dec_and_test(&adapter->uio_rx_mmaps)) {
+    nic_uio_rearm_rx(adapter);
+  }
+  nic_cdev_vma_close(vma);
+}
+
+static const struct vm_operations_struct nic_cdev_vm_ops = {
+    .open = nic_cdev_vma_open,
+    .close = nic_cdev_vma_close,
+};
+
+static const struct vm_operations_struct nic_cdev_rx_vm_ops = {
+    .open = nic_cdev_rx_vma_open,
+    .close = nic_cdev_rx_vma_close,
 };
 
 int nic_init_cdev(struct nic_drvdata *drvdata) {
@@ -79,12 +134,27 @@ int nic_cdev_open(struct inode *inode, struct file *filp) {
   struct nic_cdev_data *cdev_data;
   PRINT_INFO("nic_cdev_open\n");
   cdev_data = kzalloc(sizeof(struct nic_cdev_data), GFP_KERNEL);
+  if (!cdev_data) {
+    return -ENOMEM;
+  }
   cdev_data->cdev = inode->i_cdev;
+  init_waitqueue_head(&cdev_data->rxq.wait);
+  mutex_init(&cdev_data->lock);
+  atomic_set(&cdev_data->mmaps, 0);
 
   filp->private_data = cdev_data;
   return 0;
 }
 
+static void nic_cdev_put_raw(struct nic_cdev_data *cdev_data,
+                             struct nic_adapter *adapter) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+  nic_cdev_uring_cancel(cdev_data, adapter);
+#endif
+  nic_uio_detach_rxq(adapter, &cdev_data->rxq);
+  up(&adapter->raw_sema);
+}
+
 int nic_cdev_release(struct inode *inode, struct file *filp) {
   struct nic_cdev_data *cdev_data = filp->private_data;
   struct nic_drvdata *drvdata =
@@ -94,13 +164,53 @@ int nic_cdev_release(struct inode *inode, struct file *filp) {
 
   // release raw semaphore
   if (_IOC_NR(cdev_data->last_cmd) == NIC_IOC_NR_RW_RAW) {
-    up(&adapter->raw_sema);
+    nic_cdev_put_raw(cdev_data, adapter);
   }
 
+  mutex_destroy(&cdev_data->lock);
   kfree(cdev_data);
   return 0;
 }
 
+static int nic_cdev_recv_burst(struct nic_cdev_data *cdev_data,
+                               struct nic_adapter *adapter, u16 count,
+                               bool nonblock) {
+  int recv;
+
+  while (1) {
+    recv = nic_uio_recv_burst(adapter, &cdev_data->rxq, cdev_data->burst,
+                              count);
+    if (recv) {
+      return recv;
+    }
+    if (nonblock) {
+      return -EAGAIN;
+    }
+    // woken by the poll work when it queues frames
+    if (wait_event_killable(cdev_data->rxq.wait,
+                            READ_ONCE(cdev_data->rxq.head) !=
+                                cdev_data->rxq.tail)) {
+      PRINT_ERR("uio %d: read raw failed, killed\n", cdev_data->if_id);
+      return -EINTR;
+    }
+  }
+}
+
+static int nic_cdev_wait_tx(struct nic_cdev_data *cdev_data,
+                            struct nic_adapter *adapter, bool nonblock) {
+  struct nic_tx_ring *tx_ring = &adapter->queues[NIC_UIO_QUEUE].tx_ring;
+
+  if (nonblock) {
+    return -EAGAIN;
+  }
+  // woken by tx cleaning
+  if (wait_event_killable(adapter->uio_tx_wait, nic_uio_tx_free(tx_ring))) {
+    PRINT_ERR("uio %d: write raw failed, killed\n", cdev_data->if_id);
+    return -EINTR;
+  }
+  return 0;
+}
+
 ssize_t nic_cdev_read(struct file *filp, char __user *buf, size_t count,
                       loff_t *f_pos) {
   struct nic_cdev_data *cdev_data = filp->private_data;
@@ -114,37 +224,34 @@ ssize_t nic_cdev_read(struct file *filp, char __user *buf, size_t count,
 
   switch (_IOC_NR(cdev_data->last_cmd)) {
   case NIC_IOC_NR_RX_BD:
-    if (*f_pos + count >= sizeof(struct nic_bd) * NIC_RX_RING_QUEUES) {
+    if (*f_pos + count >= sizeof(struct nic_bd) *
+                              adapter->queues[NIC_UIO_QUEUE].rx_ring.bd_size) {
       PRINT_ERR("uio %d: read rx bd failed, overflow\n", cdev_data->if_id);
       return 0;
     }
-    err = copy_to_user(buf, adapter->rx_ring.bd_va, count);
+    err = copy_to_user(buf, adapter->queues[NIC_UIO_QUEUE].rx_ring.bd_va,
+                       count);
     if (err) {
       PRINT_ERR("uio %d: copy_to_user failed\n", cdev_data->if_id);
       return -EFAULT;
     }
     return count;
     break;
-  case NIC_IOC_NR_RW_RAW: {
-    struct nic_uio_rx_buf uio_rx_buf;
-    adapter->uio_rx_buf = &uio_rx_buf;
-    up(&adapter->raw_rx_wait_sema);
-    if (down_killable(&adapter->raw_rx_sema)) {
-      PRINT_ERR("uio %d: read raw failed, killed\n", cdev_data->if_id);
-      err = down_trylock(&adapter->raw_rx_wait_sema);
+  case NIC_IOC_NR_RW_RAW:
+    if (mutex_lock_killable(&cdev_data->lock)) {
       return -EINTR;
     }
-
-    err = copy_to_user(buf, uio_rx_buf.buf, uio_rx_buf.len);
-    if (err) {
-      PRINT_ERR("uio %d: copy_to_user failed\n", cdev_data->if_id);
-      return -EFAULT;
+    cdev_data->burst[0].buf = (u64)(uintptr_t)buf;
+    cdev_data->burst[0].len = min_t(size_t, count, U16_MAX);
+    err = nic_cdev_recv_burst(cdev_data, adapter, 1,
+                              filp->f_flags & O_NONBLOCK);
+    // read cannot return more than it copied, the cut shows in the
+    // uio_rx_truncated stat
+    if (err >= 0) {
+      err = min_t(size_t, cdev_data->burst[0].len, count);
     }
-
-    return uio_rx_buf.len;
-  }
-
-  break;
+    mutex_unlock(&cdev_data->lock);
+    return err;
   default:
     PRINT_ERR("invalid read cmd\n");
     break;
@@ -167,7 +274,15 @@ ssize_t nic_cdev_write(struct file *filp, const char __user *buf, size_t count,
     struct nic_uio_tx_buf uio_tx_buf;
     uio_tx_buf.buf = buf;
     uio_tx_buf.len = count;
-    nic_uio_xmit_frame(adapter, &uio_tx_buf);
+    while ((err = nic_uio_xmit_frame(adapter, &uio_tx_buf)) == -EAGAIN) {
+      err = nic_cdev_wait_tx(cdev_data, adapter, filp->f_flags & O_NONBLOCK);
+      if (err) {
+        return err;
+      }
+    }
+    if (err) {
+      return err;
+    }
   } break;
   default:
     PRINT_ERR("invalid write cmd\n");
@@ -176,21 +291,140 @@ ssize_t nic_cdev_write(struct file *filp, const char __user *buf, size_t count,
   return count;
 }
 
+static long nic_cdev_ioctl_burst(struct nic_cdev_data *cdev_data,
+                                 struct nic_adapter *adapter, unsigned int cmd,
+                                 unsigned long arg, bool nonblock) {
+  struct nic_burst __user *uburst = (void __user *)arg;
+  struct nic_burst burst;
+  u32 count;
+  int done;
+
+  if (copy_from_user(&burst, uburst, sizeof(burst))) {
+    return -EFAULT;
+  }
+  count = min_t(u32, burst.count, NIC_BURST_MAX);
+  if (!count) {
+    return 0;
+  }
+  if (mutex_lock_killable(&cdev_data->lock)) {
+    return -EINTR;
+  }
+  if (copy_from_user(cdev_data->burst, u64_to_user_ptr(burst.frames),
+                     sizeof(struct nic_burst_frame) * count)) {
+    done = -EFAULT;
+    goto out;
+  }
+
+  if (_IOC_NR(cmd) == NIC_IOC_NR_RECV_BURST) {
+    done = nic_cdev_recv_burst(cdev_data, adapter, count, nonblock);
+  } else {
+    while ((done = nic_uio_xmit_burst(adapter, cdev_data->burst, count)) ==
+           0) {
+      done = nic_cdev_wait_tx(cdev_data, adapter, nonblock);
+      if (done) {
+        break;
+      }
+    }
+  }
+  if (done < 0) {
+    goto out;
+  }
+
+  // lengths and ports of received frames go back to the caller
+  if (_IOC_NR(cmd) == NIC_IOC_NR_RECV_BURST &&
+      copy_to_user(u64_to_user_ptr(burst.frames), cdev_data->burst,
+                   sizeof(struct nic_burst_frame) * done)) {
+    done = -EFAULT;
+    goto out;
+  }
+  if (put_user(done, &uburst->done)) {
+    done = -EFAULT;
+  }
+
+out:
+  mutex_unlock(&cdev_data->lock);
+  return done;
+}
+
+static long nic_cdev_ioctl_raw(struct file *filp,
+                               struct nic_cdev_data *cdev_data,
+                               struct nic_adapter *adapter, unsigned int cmd,
+                               unsigned long arg) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+
+  switch (_IOC_NR(cmd)) {
+  case NIC_IOC_NR_RECV_BURST:
+  case NIC_IOC_NR_SEND_BURST:
+    return nic_cdev_ioctl_burst(cdev_data, adapter, cmd, arg,
+                                filp->f_flags & O_NONBLOCK);
+  case NIC_IOC_NR_RX_RELEASE:
+    if (arg > queue->rx_ring.bd_size) {
+      PRINT_ERR("invalid arg\n");
+      return -EINVAL;
+    }
+    return nic_uio_release_rx(adapter, arg);
+  case NIC_IOC_NR_TX_KICK:
+    if (arg > queue->tx_ring.bd_size) {
+      PRINT_ERR("invalid arg\n");
+      return -EINVAL;
+    }
+    return nic_uio_kick_tx(adapter, arg);
+  case NIC_IOC_NR_RING_INFO: {
+    struct nic_ring_info info;
+    info.rx_bd_size = queue->rx_ring.bd_size;
+    info.rx_next_to_use = queue->rx_ring.next_to_use;
+    info.tx_bd_size = queue->tx_ring.bd_size;
+    info.tx_next_to_use = queue->tx_ring.next_to_use;
+    info.rx_drops = cdev_data->rxq.drops;
+    if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
+      return -EFAULT;
+    }
+  } break;
+  default:
+    break;
+  }
+  return 0;
+}
+
 long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
   struct nic_cdev_data *cdev_data = filp->private_data;
   struct cdev *cdev = cdev_data->cdev;
   struct nic_drvdata *drvdata = container_of(cdev, struct nic_drvdata, c_dev);
   struct nic_adapter *adapter;
   int i;
+  int q;
 
   // PRINT_INFO("nic_cdev_ioctl\n");
   if (_IOC_TYPE(cmd) != NIC_IOC_MAGIC) {
     return -ENOTTY;
   }
 
+  // data path cmds, keep the raw port acquired by NIC_IOC_NR_RW_RAW
+  switch (_IOC_NR(cmd)) {
+  case NIC_IOC_NR_RX_RELEASE:
+  case NIC_IOC_NR_RING_INFO:
+  case NIC_IOC_NR_TX_KICK:
+  case NIC_IOC_NR_RECV_BURST:
+  case NIC_IOC_NR_SEND_BURST:
+    if (_IOC_NR(cdev_data->last_cmd) != NIC_IOC_NR_RW_RAW) {
+      PRINT_ERR("uio %d: raw port not acquired\n", cdev_data->if_id);
+      return -EPERM;
+    }
+    adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+    return nic_cdev_ioctl_raw(filp, cdev_data, adapter, cmd, arg);
+  default:
+    break;
+  }
+
   // release raw semaphore
   if (_IOC_NR(cdev_data->last_cmd) == NIC_IOC_NR_RW_RAW) {
-    up(&adapter->raw_sema);
+    // the next owner would share the mapped frames and tx ctl page
+    if (atomic_read(&cdev_data->mmaps)) {
+      PRINT_ERR("uio %d: raw port is mapped\n", cdev_data->if_id);
+      return -EBUSY;
+    }
+    adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+    nic_cdev_put_raw(cdev_data, adapter);
   }
 
   cdev_data->last_cmd = cmd;
@@ -200,7 +434,9 @@ long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     // PRINT_INFO("NIC_IOC_NR_SET_HW\n");
     for (i = 0; i < NIC_IF_NUM; i++) {
       adapter = netdev_priv(drvdata->netdevs[i]);
-      nic_set_hw(adapter);
+      for (q = 0; q < adapter->num_queues; q++) {
+        nic_set_hw(&adapter->queues[q]);
+      }
     }
     break;
   case NIC_IOC_NR_RX_BD:
@@ -218,8 +454,7 @@ long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
       return -EINVAL;
     }
     adapter = netdev_priv(drvdata->netdevs[arg]);
-    adapter->uio_enabled = 1;
-    break;
+    return nic_uio_enable(adapter);
   case NIC_IOC_NR_UIO_DIS:
     // PRINT_INFO("NIC_IOC_NR_UIO_DIS\n");
     if (CHECK_IF_NR(arg)) {
@@ -227,8 +462,7 @@ long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
       return -EINVAL;
     }
     adapter = netdev_priv(drvdata->netdevs[arg]);
-    adapter->uio_enabled = 0;
-    break;
+    return nic_uio_disable(adapter);
   case NIC_IOC_NR_RW_RAW:
     // PRINT_INFO("NIC_IOC_NR_RW_RAW\n");
     if (CHECK_IF_NR(arg)) {
@@ -246,6 +480,10 @@ long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
       return -EBUSY;
     }
     cdev_data->if_id = arg;
+    spin_lock_bh(&adapter->uio_uring_lock);
+    cdev_data->uring_closed = false;
+    spin_unlock_bh(&adapter->uio_uring_lock);
+    nic_uio_attach_rxq(adapter, &cdev_data->rxq);
     break;
   default:
     PRINT_ERR("invalid cmd\n");
@@ -257,4 +495,355 @@ long nic_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 loff_t nic_cdev_llseek(struct file *filp, loff_t off, int whence) {
   PRINT_INFO("nic_cdev_llseek\n");
   return 0;
-}
\ No newline at end of file
+}
+
+int nic_cdev_mmap(struct file *filp, struct vm_area_struct *vma) {
+  struct nic_cdev_data *cdev_data = filp->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter;
+  struct nic_rx_ring *rx_ring;
+  struct nic_tx_ring *tx_ring;
+  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  int err;
+
+  if (_IOC_NR(cdev_data->last_cmd) != NIC_IOC_NR_RW_RAW) {
+    PRINT_ERR("uio %d: mmap failed, raw port not acquired\n",
+              cdev_data->if_id);
+    return -EPERM;
+  }
+  adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+  rx_ring = &adapter->queues[NIC_UIO_QUEUE].rx_ring;
+  tx_ring = &adapter->queues[NIC_UIO_QUEUE].tx_ring;
+
+  // only uio mode keeps every rx slot on its coherent frame
+  if ((offset == NIC_MMAP_RX_FRAME_OFFSET ||
+       offset == NIC_MMAP_RX_BD_OFFSET) &&
+      !adapter->uio_enabled) {
+    PRINT_ERR("uio %d: mmap rx failed, uio disabled\n", cdev_data->if_id);
+    return -EPERM;
+  }
+
+  // the offset only selects the region
+  vma->vm_pgoff = 0;
+
+  switch (offset) {
+  case NIC_MMAP_RX_FRAME_OFFSET:
+    if (size > PAGE_ALIGN(sizeof(struct nic_rx_frame) * rx_ring->bd_size)) {
+      PRINT_ERR("uio %d: mmap rx frame failed, overflow\n", cdev_data->if_id);
+      return -EINVAL;
+    }
+    err = dma_mmap_coherent(&adapter->pdev->dev, vma, rx_ring->data_va,
+                            rx_ring->data_pa,
+                            sizeof(struct nic_rx_frame) * rx_ring->bd_size);
+    if (err) {
+      break;
+    }
+    // frames are consumed in place while the mapping exists
+    vma->vm_private_data = adapter;
+    vma->vm_ops = &nic_cdev_rx_vm_ops;
+    nic_cdev_rx_vma_open(vma);
+    return 0;
+  case NIC_MMAP_RX_BD_OFFSET:
+    if (size > rx_ring->bd_dma_size) {
+      PRINT_ERR("uio %d: mmap rx bd failed, overflow\n", cdev_data->if_id);
+      return -EINVAL;
+    }
+    // descriptors are owned by the driver, read only for userspace
+    if (vma->vm_flags & VM_WRITE) {
+      PRINT_ERR("uio %d: mmap rx bd failed, read only\n", cdev_data->if_id);
+      return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    err = dma_mmap_coherent(&adapter->pdev->dev, vma, rx_ring->bd_va,
+                            rx_ring->bd_pa, rx_ring->bd_dma_size);
+    break;
+  case NIC_MMAP_TX_FRAME_OFFSET:
+    if (size > PAGE_ALIGN(sizeof(struct nic_tx_frame) * tx_ring->bd_size)) {
+      PRINT_ERR("uio %d: mmap tx frame failed, overflow\n", cdev_data->if_id);
+      return -EINVAL;
+    }
+    err = dma_mmap_coherent(&adapter->pdev->dev, vma, tx_ring->uio_data_va,
+                            tx_ring->uio_data_pa,
+                            sizeof(struct nic_tx_frame) * tx_ring->bd_size);
+    break;
+  case NIC_MMAP_TX_CTL_OFFSET:
+    if (size > PAGE_SIZE) {
+      PRINT_ERR("uio %d: mmap tx ctl failed, overflow\n", cdev_data->if_id);
+      return -EINVAL;
+    }
+    err = remap_pfn_range(vma, vma->vm_start,
+                          virt_to_phys(tx_ring->uio_ctl) >> PAGE_SHIFT, size,
+                          vma->vm_page_prot);
+    break;
+  default:
+    PRINT_ERR("uio %d: invalid mmap offset %lx\n", cdev_data->if_id, offset);
+    return -EINVAL;
+  }
+
+  if (err) {
+    PRINT_ERR("uio %d: mmap failed\n", cdev_data->if_id);
+    return err;
+  }
+
+  vma->vm_private_data = adapter;
+  vma->vm_ops = &nic_cdev_vm_ops;
+  nic_cdev_vma_open(vma);
+  return 0;
+}
+
+__poll_t nic_cdev_poll(struct file *filp, struct poll_table_struct *wait) {
+  struct nic_cdev_data *cdev_data = filp->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter;
+  __poll_t mask = 0;
+
+  if (_IOC_NR(cdev_data->last_cmd) != NIC_IOC_NR_RW_RAW) {
+    return EPOLLERR;
+  }
+  adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+
+  poll_wait(filp, &cdev_data->rxq.wait, wait);
+  poll_wait(filp, &adapter->uio_tx_wait, wait);
+
+  if (nic_uio_rx_pending(adapter, &cdev_data->rxq)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  if (nic_uio_tx_free(&adapter->queues[NIC_UIO_QUEUE].tx_ring)) {
+    mask |= EPOLLOUT | EPOLLWRNORM;
+  }
+
+  return mask;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+// io_uring
+
+struct nic_uring_pdu {
+  struct list_head list;
+  u64 frames;
+  u16 count;
+  bool cancel;
+};
+
+static struct nic_uring_pdu *nic_uring_pdu(struct io_uring_cmd *ioucmd) {
+  BUILD_BUG_ON(sizeof(struct nic_uring_pdu) > sizeof(ioucmd->pdu));
+  return (struct nic_uring_pdu *)ioucmd->pdu;
+}
+
+// runs in the submitter's context, frames are copied in chunks
+static int nic_cdev_uring_xfer(struct io_uring_cmd *ioucmd) {
+  struct nic_cdev_data *cdev_data = ioucmd->file->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+  struct nic_uring_pdu *pdu = nic_uring_pdu(ioucmd);
+  struct nic_burst_frame __user *uframes = u64_to_user_ptr(pdu->frames);
+  struct nic_burst_frame frames[NIC_URING_CHUNK];
+  int done = 0;
+  int n;
+  int ret;
+
+  while (done < pdu->count) {
+    n = min_t(int, pdu->count - done, NIC_URING_CHUNK);
+    if (copy_from_user(frames, uframes + done, sizeof(frames[0]) * n)) {
+      return done ? done : -EFAULT;
+    }
+
+    if (ioucmd->cmd_op == NIC_URING_CMD_RECV) {
+      // a blocked read holds the lock, this cmd waits for the next kick
+      if (!mutex_trylock(&cdev_data->lock)) {
+        return done;
+      }
+      ret = nic_uio_recv_burst(adapter, &cdev_data->rxq, frames, n);
+      mutex_unlock(&cdev_data->lock);
+    } else {
+      ret = nic_uio_xmit_burst(adapter, frames, n);
+    }
+    if (ret <= 0) {
+      return done ? done : ret;
+    }
+
+    if (ioucmd->cmd_op == NIC_URING_CMD_RECV &&
+        copy_to_user(uframes + done, frames, sizeof(frames[0]) * ret)) {
+      return -EFAULT;
+    }
+    done += ret;
+    if (ret < n) {
+      break;
+    }
+  }
+  return done;
+}
+
+static bool nic_cdev_uring_ready(struct io_uring_cmd *ioucmd) {
+  struct nic_cdev_data *cdev_data = ioucmd->file->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+
+  if (ioucmd->cmd_op == NIC_URING_CMD_RECV) {
+    return nic_uio_rx_pending(adapter, &cdev_data->rxq);
+  }
+  return nic_uio_tx_free(&adapter->queues[NIC_UIO_QUEUE].tx_ring);
+}
+
+static bool nic_cdev_uring_queue(struct io_uring_cmd *ioucmd);
+
+static void nic_cdev_uring_cb(struct io_uring_cmd *ioucmd,
+                              unsigned int issue_flags) {
+  struct nic_uring_pdu *pdu = nic_uring_pdu(ioucmd);
+  int ret = -ECANCELED;
+
+  if (!pdu->cancel) {
+    ret = nic_cdev_uring_xfer(ioucmd);
+    // the kick was spurious, wait for the next one unless the port was
+    // released meanwhile
+    if (!ret) {
+      if (nic_cdev_uring_queue(ioucmd)) {
+        return;
+      }
+      ret = -ECANCELED;
+    }
+  }
+
+  io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+// hand every pending cmd of the list to task context in order, a cmd
+// that finds nothing left parks itself again
+void nic_cdev_uring_kick(struct nic_adapter *adapter, struct list_head *cmds) {
+  struct nic_uring_pdu *pdu, *tmp;
+  LIST_HEAD(kicked);
+
+  spin_lock_bh(&adapter->uio_uring_lock);
+  list_splice_init(cmds, &kicked);
+  spin_unlock_bh(&adapter->uio_uring_lock);
+
+  list_for_each_entry_safe(pdu, tmp, &kicked, list) {
+    list_del_init(&pdu->list);
+    io_uring_cmd_complete_in_task(
+        container_of((void *)pdu, struct io_uring_cmd, pdu),
+        nic_cdev_uring_cb);
+  }
+}
+
+// false once the raw port is released, the caller completes the cmd
+static bool nic_cdev_uring_queue(struct io_uring_cmd *ioucmd) {
+  struct nic_cdev_data *cdev_data = ioucmd->file->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+  struct list_head *cmds = ioucmd->cmd_op == NIC_URING_CMD_RECV
+                               ? &adapter->uio_uring_rx
+                               : &adapter->uio_uring_tx;
+
+  spin_lock_bh(&adapter->uio_uring_lock);
+  if (cdev_data->uring_closed) {
+    spin_unlock_bh(&adapter->uio_uring_lock);
+    return false;
+  }
+  list_add_tail(&nic_uring_pdu(ioucmd)->list, cmds);
+  spin_unlock_bh(&adapter->uio_uring_lock);
+
+  // frames may have arrived before the cmd was queued
+  if (nic_cdev_uring_ready(ioucmd)) {
+    nic_cdev_uring_kick(adapter, cmds);
+  }
+  return true;
+}
+
+static void nic_cdev_uring_cancel(struct nic_cdev_data *cdev_data,
+                                  struct nic_adapter *adapter) {
+  struct nic_uring_pdu *pdu, *tmp;
+  LIST_HEAD(cmds);
+
+  spin_lock_bh(&adapter->uio_uring_lock);
+  cdev_data->uring_closed = true;
+  list_splice_init(&adapter->uio_uring_rx, &cmds);
+  list_splice_init(&adapter->uio_uring_tx, &cmds);
+  spin_unlock_bh(&adapter->uio_uring_lock);
+
+  list_for_each_entry_safe(pdu, tmp, &cmds, list) {
+    list_del_init(&pdu->list);
+    pdu->cancel = true;
+    io_uring_cmd_complete_in_task(
+        container_of((void *)pdu, struct io_uring_cmd, pdu),
+        nic_cdev_uring_cb);
+  }
+}
+
+// ring teardown or task exit, the parked cmd would otherwise pin the file
+static void nic_cdev_uring_cancel_cmd(struct io_uring_cmd *ioucmd,
+                                      unsigned int issue_flags) {
+  struct nic_cdev_data *cdev_data = ioucmd->file->private_data;
+  struct nic_drvdata *drvdata =
+      container_of(cdev_data->cdev, struct nic_drvdata, c_dev);
+  struct nic_adapter *adapter = netdev_priv(drvdata->netdevs[cdev_data->if_id]);
+  struct nic_uring_pdu *pdu = nic_uring_pdu(ioucmd);
+  bool parked;
+
+  spin_lock_bh(&adapter->uio_uring_lock);
+  parked = !list_empty(&pdu->list);
+  list_del_init(&pdu->list);
+  spin_unlock_bh(&adapter->uio_uring_lock);
+
+  // otherwise a kick already handed it to task work
+  if (parked) {
+    io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+  }
+}
+
+int nic_cdev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+  struct nic_cdev_data *cdev_data = ioucmd->file->private_data;
+  const struct nic_uring_cmd *cmd = ioucmd->cmd;
+  struct nic_uring_pdu *pdu = nic_uring_pdu(ioucmd);
+  int ret;
+
+  if (issue_flags & IO_URING_F_CANCEL) {
+    nic_cdev_uring_cancel_cmd(ioucmd, issue_flags);
+    return 0;
+  }
+
+  if (_IOC_NR(cdev_data->last_cmd) != NIC_IOC_NR_RW_RAW) {
+    PRINT_ERR("uio %d: raw port not acquired\n", cdev_data->if_id);
+    return -EPERM;
+  }
+
+  switch (ioucmd->cmd_op) {
+  case NIC_URING_CMD_RECV:
+  case NIC_URING_CMD_SEND:
+    break;
+  default:
+    return -ENOTTY;
+  }
+
+  // the sqe may be reused once we return
+  pdu->frames = READ_ONCE(cmd->frames);
+  pdu->count = min_t(u32, READ_ONCE(cmd->count), U16_MAX);
+  pdu->cancel = false;
+  INIT_LIST_HEAD(&pdu->list);
+  if (!pdu->count) {
+    return 0;
+  }
+
+  ret = nic_cdev_uring_xfer(ioucmd);
+  if (ret) {
+    return ret;
+  }
+
+  // completed later from the poll work or tx cleaning, or cancelled by
+  // io_uring on ring teardown
+  io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+  if (!nic_cdev_uring_queue(ioucmd)) {
+    io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+  }
+  return -EIOCBQUEUED;
+}
+#endif
@@ -3,17 +3,40 @@
 
 #include "nic.h"
 #include <linux/cdev.h>
+#include <linux/io_uring.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <linux/io_uring/cmd.h>
+#endif
 
 #define NIC_CDEV_DEVS 1
 
+#define NIC_URING_CHUNK 16
+
 int nic_init_cdev(struct nic_drvdata *drvdata);
 
 void nic_exit_cdev(struct nic_drvdata *drvdata);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+void nic_cdev_uring_kick(struct nic_adapter *adapter, struct list_head *cmds);
+#else
+// nothing is ever parked without .uring_cmd
+static inline void nic_cdev_uring_kick(struct nic_adapter *adapter,
+                                       struct list_head *cmds) {}
+#endif
+
 struct nic_cdev_data {
   struct cdev *cdev;
   int last_cmd;
   u16 if_id;
+  struct nic_uio_rxq rxq;
+  // one consumer of rxq and one user of burst at a time
+  struct mutex lock;
+  struct nic_burst_frame burst[NIC_BURST_MAX];
+  // no more io_uring cmds are parked, under adapter->uio_uring_lock
+  bool uring_closed;
+  // live mappings of this file, the raw port is kept while there are any
+  atomic_t mmaps;
 };
 
 #endif
\ No newline at end of file
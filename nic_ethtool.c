@@ -11,6 +11,7 @@ for nic
 #include "nic.h"
 #include <linux/jiffies.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
 
 // static u32 nic_get_msglevel(struct net_device *netdev)
 // {
@@ -57,8 +58,236 @@ static int nic_get_link_ksettings(struct net_device *netdev,
   return 0;
 }
 
+static int nic_get_coalesce(struct net_device *netdev,
+                            struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal,
+                            struct netlink_ext_ack *extack) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  ec->rx_coalesce_usecs = adapter->rx_coalesce_usecs;
+  ec->rx_max_coalesced_frames = adapter->rx_max_frames;
+  ec->use_adaptive_rx_coalesce = adapter->rx_adaptive;
+  // doorbell batching, see nic_xmit_frame and nic_rx_post_sync
+  ec->tx_max_coalesced_frames = adapter->tx_max_frames;
+  ec->tx_coalesce_usecs = adapter->tx_coalesce_usecs;
+  ec->rx_max_coalesced_frames_irq = adapter->rx_sync_num;
+  return 0;
+}
+
+static int nic_set_coalesce(struct net_device *netdev,
+                            struct ethtool_coalesce *ec,
+                            struct kernel_ethtool_coalesce *kernel_coal,
+                            struct netlink_ext_ack *extack) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  if (ec->rx_coalesce_usecs > NIC_RX_USECS_MAX) {
+    NL_SET_ERR_MSG_MOD(extack, "rx-usecs out of range");
+    return -EINVAL;
+  }
+  if (ec->rx_max_coalesced_frames > adapter->rx_ring_size) {
+    NL_SET_ERR_MSG_MOD(extack, "rx-frames out of range");
+    return -EINVAL;
+  }
+  if (!ec->tx_max_coalesced_frames ||
+      ec->tx_max_coalesced_frames >= adapter->tx_ring_size) {
+    NL_SET_ERR_MSG_MOD(extack, "tx-frames out of range");
+    return -EINVAL;
+  }
+  if (ec->tx_coalesce_usecs > NIC_TX_USECS_MAX) {
+    NL_SET_ERR_MSG_MOD(extack, "tx-usecs out of range");
+    return -EINVAL;
+  }
+  // the refill has to stay behind next_to_use
+  if (!ec->rx_max_coalesced_frames_irq ||
+      ec->rx_max_coalesced_frames_irq > adapter->rx_ring_size / 2) {
+    NL_SET_ERR_MSG_MOD(extack, "rx-frames-irq out of range");
+    return -EINVAL;
+  }
+
+  adapter->rx_coalesce_usecs = ec->rx_coalesce_usecs;
+  WRITE_ONCE(adapter->rx_max_frames, ec->rx_max_coalesced_frames);
+  WRITE_ONCE(adapter->rx_adaptive, ec->use_adaptive_rx_coalesce);
+  WRITE_ONCE(adapter->tx_max_frames, ec->tx_max_coalesced_frames);
+  WRITE_ONCE(adapter->tx_coalesce_usecs, ec->tx_coalesce_usecs);
+  WRITE_ONCE(adapter->rx_sync_num, ec->rx_max_coalesced_frames_irq);
+  // dim takes over from the next sample, a fixed value applies right away
+  if (!adapter->rx_adaptive) {
+    nic_set_rx_usecs(adapter, adapter->rx_coalesce_usecs);
+  }
+  return 0;
+}
+
+static void nic_get_ringparam(struct net_device *netdev,
+                              struct ethtool_ringparam *ring,
+                              struct kernel_ethtool_ringparam *kernel_ring,
+                              struct netlink_ext_ack *extack) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  // fixed until the size can be programmed, see nic_set_ringparam
+  ring->rx_max_pending = NIC_RX_RING_QUEUES;
+  ring->tx_max_pending = NIC_TX_RING_QUEUES;
+  ring->rx_pending = adapter->rx_ring_size;
+  ring->tx_pending = adapter->tx_ring_size;
+}
+
+static int nic_set_ringparam(struct net_device *netdev,
+                             struct ethtool_ringparam *ring,
+                             struct kernel_ethtool_ringparam *kernel_ring,
+                             struct netlink_ext_ack *extack) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  if (ring->rx_mini_pending || ring->rx_jumbo_pending) {
+    return -EINVAL;
+  }
+  // the device walks rings of its own size, a smaller one would have it
+  // fetch descriptors past the end, a larger one never wraps for it
+  if (ring->rx_pending != NIC_RX_RING_QUEUES ||
+      ring->tx_pending != NIC_TX_RING_QUEUES) {
+    NL_SET_ERR_MSG_MOD(extack, "ring size is fixed by the device");
+    return -EINVAL;
+  }
+  // the coalesce batches have to fit in the new rings
+  if (adapter->tx_max_frames >= ring->tx_pending ||
+      adapter->rx_sync_num > ring->rx_pending / 2 ||
+      adapter->rx_max_frames > ring->rx_pending) {
+    NL_SET_ERR_MSG_MOD(extack, "coalesce frames exceed ring size");
+    return -EINVAL;
+  }
+  if (ring->rx_pending == adapter->rx_ring_size &&
+      ring->tx_pending == adapter->tx_ring_size) {
+    return 0;
+  }
+
+  return nic_resize_rings(adapter, ring->tx_pending, ring->rx_pending);
+}
+
+// per queue, in the order of struct nic_queue_stats
+static const char nic_queue_stat_names[][ETH_GSTRING_LEN] = {
+    "tx_packets",   "tx_bytes",     "tx_dropped", "tx_doorbells",
+    "tx_ring_full", "tx_irqs",      "rx_packets", "rx_bytes",
+    "rx_dropped",   "rx_doorbells", "rx_irqs",    "poll_exhausted",
+    "xdp_drop",     "xdp_tx",       "xdp_redirect", "uio_tx_bad_len",
+    "uio_rx_truncated",
+};
+
+static int nic_get_sset_count(struct net_device *netdev, int sset) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  BUILD_BUG_ON(ARRAY_SIZE(nic_queue_stat_names) != NIC_QUEUE_STATS_LEN);
+  switch (sset) {
+  case ETH_SS_STATS:
+    return adapter->num_queues * NIC_QUEUE_STATS_LEN;
+  default:
+    return -EOPNOTSUPP;
+  }
+}
+
+static void nic_get_strings(struct net_device *netdev, u32 sset, u8 *data) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  int q, i;
+
+  if (sset != ETH_SS_STATS) {
+    return;
+  }
+  for (q = 0; q < adapter->num_queues; q++) {
+    for (i = 0; i < NIC_QUEUE_STATS_LEN; i++) {
+      ethtool_sprintf(&data, "q%d_%s", q, nic_queue_stat_names[i]);
+    }
+  }
+}
+
+static void nic_get_ethtool_stats(struct net_device *netdev,
+                                  struct ethtool_stats *stats, u64 *data) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  int q;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    nic_queue_stats_read(&adapter->queues[q], data);
+    data += NIC_QUEUE_STATS_LEN;
+  }
+}
+
+// rss rings are cpus, see nic_rss_steer
+static int nic_get_rxnfc(struct net_device *netdev, struct ethtool_rxnfc *cmd,
+                         u32 *rule_locs) {
+  switch (cmd->cmd) {
+  case ETHTOOL_GRXRINGS:
+    cmd->data = nr_cpu_ids;
+    return 0;
+  default:
+    return -EOPNOTSUPP;
+  }
+}
+
+static u32 nic_get_rxfh_key_size(struct net_device *netdev) {
+  return NIC_RSS_KEY_SIZE;
+}
+
+static u32 nic_get_rxfh_indir_size(struct net_device *netdev) {
+  return NIC_RSS_INDIR_SIZE;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+static int nic_get_rxfh(struct net_device *netdev,
+                        struct ethtool_rxfh_param *rxfh) {
+  u32 *indir = rxfh->indir;
+  u8 *key = rxfh->key;
+  u8 *hfunc = &rxfh->hfunc;
+#else
+static int nic_get_rxfh(struct net_device *netdev, u32 *indir, u8 *key,
+                        u8 *hfunc) {
+#endif
+  struct nic_adapter *adapter = netdev_priv(netdev);
+
+  if (hfunc) {
+    *hfunc = ETH_RSS_HASH_TOP;
+  }
+  if (indir) {
+    memcpy(indir, adapter->rss_indir, sizeof(adapter->rss_indir));
+  }
+  if (key) {
+    memcpy(key, adapter->rss_key, NIC_RSS_KEY_SIZE);
+  }
+  return 0;
+}
+
+// frames already steered finish on their old cpu, a flow that moves may
+// be reordered once
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+static int nic_set_rxfh(struct net_device *netdev,
+                        struct ethtool_rxfh_param *rxfh,
+                        struct netlink_ext_ack *extack) {
+  const u32 *indir = rxfh->indir;
+  const u8 *key = rxfh->key;
+  const u8 hfunc = rxfh->hfunc;
+#else
+static int nic_set_rxfh(struct net_device *netdev, const u32 *indir,
+                        const u8 *key, const u8 hfunc) {
+#endif
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  int i;
+
+  if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP) {
+    return -EOPNOTSUPP;
+  }
+  if (indir) {
+    for (i = 0; i < NIC_RSS_INDIR_SIZE; i++) {
+      WRITE_ONCE(adapter->rss_indir[i], indir[i]);
+    }
+  }
+  if (key) {
+    memcpy(adapter->rss_key, key, NIC_RSS_KEY_SIZE);
+  }
+  return 0;
+}
+
 static const struct ethtool_ops nic_ethtool_ops = {
-    // .supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS,
+    .supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+                                 ETHTOOL_COALESCE_RX_MAX_FRAMES |
+                                 ETHTOOL_COALESCE_USE_ADAPTIVE_RX |
+                                 ETHTOOL_COALESCE_RX_MAX_FRAMES_IRQ |
+                                 ETHTOOL_COALESCE_TX_USECS |
+                                 ETHTOOL_COALESCE_TX_MAX_FRAMES,
     // .get_drvinfo		= nic_get_drvinfo,
     // .get_regs_len		= nic_get_regs_len,
     // .get_regs		= nic_get_regs,
@@ -71,20 +300,25 @@ static const struct ethtool_ops nic_ethtool_ops = {
     // .get_eeprom_len		= nic_get_eeprom_len,
     // .get_eeprom		= nic_get_eeprom,
     // .set_eeprom		= nic_set_eeprom,
-    // .get_ringparam		= nic_get_ringparam,
-    // .set_ringparam		= nic_set_ringparam,
+    .get_ringparam = nic_get_ringparam,
+    .set_ringparam = nic_set_ringparam,
     // .get_pauseparam		= nic_get_pauseparam,
     // .set_pauseparam		= nic_set_pauseparam,
     // .self_test		= nic_diag_test,
-    // .get_strings		= nic_get_strings,
+    .get_strings = nic_get_strings,
     // .set_phys_id		= nic_set_phys_id,
-    // .get_ethtool_stats	= nic_get_ethtool_stats,
-    // .get_sset_count		= nic_get_sset_count,
-    // .get_coalesce		= nic_get_coalesce,
-    // .set_coalesce		= nic_set_coalesce,
+    .get_ethtool_stats = nic_get_ethtool_stats,
+    .get_sset_count = nic_get_sset_count,
+    .get_coalesce = nic_get_coalesce,
+    .set_coalesce = nic_set_coalesce,
     // .get_ts_info		= ethtool_op_get_ts_info,
     .get_link_ksettings = nic_get_link_ksettings,
     // .set_link_ksettings	= nic_set_link_ksettings,
+    .get_rxnfc = nic_get_rxnfc,
+    .get_rxfh_key_size = nic_get_rxfh_key_size,
+    .get_rxfh_indir_size = nic_get_rxfh_indir_size,
+    .get_rxfh = nic_get_rxfh,
+    .set_rxfh = nic_set_rxfh,
 };
 
 void nic_set_ethtool_ops(struct net_device *netdev) {
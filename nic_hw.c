@@ -1,79 +1,121 @@
 #include "nic_hw.h"
 #include "nic.h"
+#include "nic_trace.h"
 
-void nic_set_hw(struct nic_adapter *adapter) {
-  struct nic_tx_ring *tx_ring = &adapter->tx_ring;
-  struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+#ifdef NO_INT
+static unsigned int emu_int_min_us = NIC_EMU_INT_MIN_US;
+module_param(emu_int_min_us, uint, 0644);
+MODULE_PARM_DESC(emu_int_min_us, "shortest emulated interrupt interval (us)");
+
+static unsigned int emu_int_max_us = NIC_EMU_INT_MAX_US;
+module_param(emu_int_max_us, uint, 0644);
+MODULE_PARM_DESC(emu_int_max_us, "longest emulated interrupt interval (us)");
+
+// halve the interval when the last poll found a batch, double it when idle
+static void nic_emu_int_arm(struct nic_queue *queue, int nr) {
+  struct nic_emu_int *emu = &queue->emu_int[nr];
+  // 0 would re-arm the timer back to back forever
+  u64 min_ns = max_t(u64, READ_ONCE(emu_int_min_us), 1) * NSEC_PER_USEC;
+  u64 max_ns = (u64)READ_ONCE(emu_int_max_us) * NSEC_PER_USEC;
+  u16 size, pos, work;
+
+  if (nr == NIC_VEC_TX) {
+    size = queue->tx_ring.bd_size;
+    pos = queue->tx_ring.next_to_clean;
+  } else {
+    size = queue->rx_ring.bd_size;
+    pos = queue->rx_ring.next_to_use;
+  }
+  work = size ? (pos - emu->last_pos) & (size - 1) : 0;
+  emu->last_pos = pos;
+
+  if (work > 1) {
+    emu->interval_ns /= 2;
+  } else if (!work) {
+    // doubling alone cannot leave 0
+    emu->interval_ns = max_t(u64, emu->interval_ns * 2, min_ns);
+  }
+  emu->interval_ns = clamp(emu->interval_ns, min_ns, max(min_ns, max_ns));
+
+  hrtimer_start(&emu->timer, ns_to_ktime(emu->interval_ns), HRTIMER_MODE_REL);
+}
+#endif
+
+void nic_set_hw(struct nic_queue *queue) {
+  struct nic_adapter *adapter = queue->adapter;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
 
   netdev_info(adapter->netdev, "rx_ring->bd_pa: %llx\n", rx_ring->bd_pa);
   writel(rx_ring->bd_pa & 0xffffffff,
-         adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_LOW));
+         queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_LOW));
   writel(rx_ring->bd_pa >> 32,
-         adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_HIGH));
+         queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_HIGH));
 
   netdev_info(adapter->netdev, "rx_ring->bd_size: %d\n", rx_ring->bd_size);
   // writel(rx_ring->bd_size,
-  //        adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_SIZE));
+  //        queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_SIZE));
 
   netdev_info(adapter->netdev, "tx_ring->bd_pa: %llx\n", tx_ring->bd_pa);
   writel(tx_ring->bd_pa & 0xffffffff,
-         adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_LOW));
+         queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_LOW));
   writel(tx_ring->bd_pa >> 32,
-         adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_HIGH));
+         queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_HIGH));
 
   netdev_info(adapter->netdev, "tx_ring->bd_size: %d\n", tx_ring->bd_size);
   // writel(tx_ring->bd_size,
-  //        adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_SIZE));
+  //        queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_SIZE));
 }
 
-void nic_unset_hw(struct nic_adapter *adapter) {
-  writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_LOW));
-  writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_HIGH));
-  // writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_SIZE));
+void nic_unset_hw(struct nic_queue *queue) {
+  writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_LOW));
+  writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_BA_HIGH));
+  // writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_SIZE));
 
-  writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_LOW));
-  writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_HIGH));
-  // writel(0, adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_SIZE));
+  writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_LOW));
+  writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_BA_HIGH));
+  // writel(0, queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_SIZE));
 }
 
-void nic_set_int(struct nic_adapter *adapter, int nr, bool enable) {
+void nic_set_int(struct nic_queue *queue, int nr, bool enable) {
 #ifdef NO_INT
-  switch (nr) {
-  case NIC_VEC_TX:
-    adapter->emu_int_tx_enabled = enable;
-    break;
-  case NIC_VEC_RX:
-    adapter->emu_int_rx_enabled = enable;
-    break;
-  default:
-    break;
+  struct nic_emu_int *emu;
+
+  if (nr != NIC_VEC_TX && nr != NIC_VEC_RX) {
+    return;
+  }
+  emu = &queue->emu_int[nr];
+  // masking may come from the timer callback itself, never cancel here
+  WRITE_ONCE(emu->enabled, enable);
+  if (enable && !READ_ONCE(emu->stopped)) {
+    nic_emu_int_arm(queue, nr);
   }
   return;
 #else
   void *csr_int_addr =
-      adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_INT_OFFSET(nr));
+      queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_INT_OFFSET(nr));
   if (enable) {
     writel(0x01, csr_int_addr);
-    netdev_info(adapter->netdev, "enable interrupt %d\n", nr);
   } else {
     writel(0x0, csr_int_addr);
-    netdev_info(adapter->netdev, "disable interrupt %d\n", nr);
   }
+  trace_nic_set_int(queue, nr, enable);
 #endif
 }
 
-void nic_update_tx_tail(struct nic_adapter *adapter) {
-  struct nic_tx_ring *tx_ring = &adapter->tx_ring;
+void nic_update_tx_tail(struct nic_queue *queue) {
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
   writel(tx_ring->next_to_use,
-         ((void *)adapter->io_addr) + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_TAIL));
-  netdev_info(adapter->netdev, "tx_ring->next_to_use: %d\n",
-              tx_ring->next_to_use);
+         ((void *)queue->io_addr) + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_TAIL));
+  trace_nic_doorbell(queue, NIC_VEC_TX, tx_ring->next_to_use);
+  NIC_STATS_INC(queue, tx_doorbells);
   tx_ring->last_sync = tx_ring->next_to_use;
 }
 
-void nic_update_rx_tail(struct nic_adapter *adapter) {
-  struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+void nic_update_rx_tail(struct nic_queue *queue) {
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
   writel(rx_ring->last_sync,
-         ((void *)adapter->io_addr) + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_TAIL));
-  netdev_info(adapter->netdev, "rx_ring->last_sync: %d\n", rx_ring->last_sync);
+         ((void *)queue->io_addr) + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_TAIL));
+  trace_nic_doorbell(queue, NIC_VEC_RX, rx_ring->last_sync);
+  NIC_STATS_INC(queue, rx_doorbells);
 }
\ No newline at end of file
@@ -55,21 +55,28 @@
 
 #define NIC_VEC_IF_SIZE 2
 
+// queue q of port i uses channel q * NIC_IF_NUM + i, so queue 0 keeps the
+// single queue layout
+#define NIC_QUEUE_CH(if_id, q) ((q) * NIC_IF_NUM + (if_id))
+
+#define NIC_QUEUE_VEC(if_id, q, tx_rx)                                         \
+  (NIC_VEC_IF_SIZE * NIC_QUEUE_CH(if_id, q) + (tx_rx))
+
 // flags
 
-#define NIC_BD_FLAG_VALID BIT(63)
+// NIC_BD_FLAG_VALID and NIC_BD_FLAG_EOP are shared with userspace, see common.h
 
 // #define NIC_BD_FLAG_USED BIT(62)
 
-void nic_set_hw(struct nic_adapter *adapter);
+void nic_set_hw(struct nic_queue *queue);
 
-void nic_unset_hw(struct nic_adapter *adapter);
+void nic_unset_hw(struct nic_queue *queue);
 
-void nic_set_int(struct nic_adapter *adapter, int nr, bool enable);
+void nic_set_int(struct nic_queue *queue, int nr, bool enable);
 
-void nic_update_tx_tail(struct nic_adapter *adapter);
+void nic_update_tx_tail(struct nic_queue *queue);
 
-void nic_update_rx_tail(struct nic_adapter *adapter);
+void nic_update_rx_tail(struct nic_queue *queue);
 
 
 #endif
\ No newline at end of file
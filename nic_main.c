@@ -1,15 +1,39 @@
 #include "nic.h"
 #include "nic_cdev.h"
 #include "nic_hw.h"
+#include <linux/bpf_trace.h>
 #include <linux/dma-mapping.h>
+#include <linux/filter.h>
 #include <linux/timer.h>
 #include <linux/version.h>
+#include <net/ip6_checksum.h>
+#include <net/tso.h>
+#include <net/xdp_sock_drv.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#include <net/page_pool/helpers.h>
+#else
+#include <net/page_pool.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "nic_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("lc");
 MODULE_DESCRIPTION("NIC driver module.");
 MODULE_VERSION("0.01");
 
+static unsigned int num_queues = 1;
+module_param(num_queues, uint, 0444);
+MODULE_PARM_DESC(num_queues, "tx/rx ring pairs per port (1-8)");
+
+// the gateware has no capability register. the current one sends every
+// descriptor as a frame of its own and ignores NIC_BD_FLAG_EOP
+static bool hw_eop;
+module_param(hw_eop, bool, 0444);
+MODULE_PARM_DESC(hw_eop,
+                 "gateware joins descriptors up to eop (sg, tso, jumbo)");
+
 char nic_driver_name[] = NIC_DRIVER_NAME;
 
 static const struct pci_device_id nic_pci_tbl[] = {
@@ -63,12 +87,20 @@ int nic_open(struct net_device *netdev);
 int nic_close(struct net_device *netdev);
 static netdev_tx_t nic_xmit_frame(struct sk_buff *skb,
                                   struct net_device *netdev);
-static struct sk_buff *nic_receive_skb(struct nic_adapter *adapter);
+static struct sk_buff *nic_receive_skb(struct nic_queue *queue,
+                                       struct bpf_prog *prog,
+                                       unsigned int *xdp_res);
 static void nic_set_rx_mode(struct net_device *netdev);
+static void nic_get_stats64(struct net_device *netdev,
+                            struct rtnl_link_stats64 *stats);
 static int nic_set_mac(struct net_device *netdev, void *p);
 static void nic_tx_timeout(struct net_device *dev, unsigned int txqueue);
 static int nic_change_mtu(struct net_device *netdev, int new_mtu);
 static int nic_ioctl(struct net_device *netdev, struct ifreq *ifr, int cmd);
+static int nic_bpf(struct net_device *netdev, struct netdev_bpf *bpf);
+static int nic_xdp_xmit(struct net_device *netdev, int n,
+                        struct xdp_frame **frames, u32 flags);
+static int nic_xsk_wakeup(struct net_device *netdev, u32 qid, u32 flags);
 // static int nic_vlan_rx_add_vid(struct net_device *netdev, __be16 proto,
 //                                u16 vid);
 // static int nic_vlan_rx_kill_vid(struct net_device *netdev, __be16 proto,
@@ -80,18 +112,24 @@ static int nic_set_features(struct net_device *netdev,
                             netdev_features_t features);
 
 static int nic_poll(struct napi_struct *napi, int budget);
+static int nic_rss_poll(struct napi_struct *napi, int budget);
+static void nic_rss_ipi(void *info);
 #ifndef NO_PCI
 static irqreturn_t nic_interrupt_tx(int irq, void *data);
 static irqreturn_t nic_interrupt_rx(int irq, void *data);
-static void nic_clean_tx_ring_work(struct work_struct *work);
+static bool nic_clean_tx_ring(struct nic_queue *queue, int budget);
 static void nic_uio_poll_work(struct work_struct *work);
 #endif
+static enum hrtimer_restart nic_tx_flush_func(struct hrtimer *timer);
+static enum hrtimer_restart nic_rx_mod_func(struct hrtimer *timer);
+static void nic_rx_dim_work(struct work_struct *work);
 
 static const struct net_device_ops nic_netdev_ops = {
     .ndo_open = nic_open,
     .ndo_stop = nic_close,
     .ndo_start_xmit = nic_xmit_frame,
     .ndo_set_rx_mode = nic_set_rx_mode,
+    .ndo_get_stats64 = nic_get_stats64,
     .ndo_set_mac_address = nic_set_mac,
     .ndo_tx_timeout = nic_tx_timeout,
     .ndo_change_mtu = nic_change_mtu,
@@ -104,45 +142,74 @@ static const struct net_device_ops nic_netdev_ops = {
 #endif
     .ndo_fix_features = nic_fix_features,
     .ndo_set_features = nic_set_features,
+#ifndef NO_PCI
+    .ndo_bpf = nic_bpf,
+    .ndo_xdp_xmit = nic_xdp_xmit,
+    .ndo_xsk_wakeup = nic_xsk_wakeup,
+#endif
 };
 #endif // PCI_FN_TEST
 
-#if defined(NO_PCI) || defined(NO_INT)
+#ifdef NO_PCI
 static struct net_device *test_netdev[NIC_IF_NUM];
 #endif
 
-static struct workqueue_struct *nic_clean_wq;
 static struct workqueue_struct *nic_uio_poll_wq;
 
 #ifdef NO_INT
-// emu int
-struct timer_list emu_int_timer;
+// emu int, armed by nic_set_int
+static enum hrtimer_restart nic_emu_int_func(struct hrtimer *timer) {
+  struct nic_emu_int *emu = container_of(timer, struct nic_emu_int, timer);
+  struct nic_queue *queue = emu->queue;
 
-void test_timer_func(struct timer_list *t) {
-  int i;
-  for (i = 0; i < NIC_IF_NUM; i++) {
-    struct nic_adapter *adapter = netdev_priv(test_netdev[i]);
-    if (adapter->emu_int_tx_enabled) {
-      nic_interrupt_tx(adapter->irq_tx, test_netdev[i]);
-    }
-    if (adapter->emu_int_rx_enabled) {
-      nic_interrupt_rx(adapter->irq_rx, test_netdev[i]);
-    }
+  if (!READ_ONCE(emu->enabled)) {
+    return HRTIMER_NORESTART;
+  }
+  if (emu->nr == NIC_VEC_TX) {
+    nic_interrupt_tx(queue->irq_tx, queue);
+  } else {
+    nic_interrupt_rx(queue->irq_rx, queue);
   }
-  mod_timer(&emu_int_timer, jiffies + NIC_EMU_INT_JIFFIES);
+  return HRTIMER_NORESTART;
 }
 
+static void nic_emu_int_init(struct nic_queue *queue) {
+  int nr;
+
+  for (nr = 0; nr < NIC_EMU_INT_VECS; nr++) {
+    struct nic_emu_int *emu = &queue->emu_int[nr];
+
+    hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    emu->timer.function = nic_emu_int_func;
+    emu->queue = queue;
+    emu->nr = nr;
+    emu->enabled = false;
+    emu->stopped = false;
+    emu->interval_ns = (u64)NIC_EMU_INT_MAX_US * NSEC_PER_USEC;
+  }
+}
+
+static void nic_emu_int_stop(struct nic_adapter *adapter) {
+  int q;
+  int nr;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    for (nr = 0; nr < NIC_EMU_INT_VECS; nr++) {
+      struct nic_emu_int *emu = &adapter->queues[q].emu_int[nr];
+
+      WRITE_ONCE(emu->stopped, true);
+      WRITE_ONCE(emu->enabled, false);
+      hrtimer_cancel(&emu->timer);
+    }
+  }
+}
 #endif
 
 static int __init nic_init_module(void) {
   int ret;
   PRINT_INFO("nic_init_module\n");
 
-  nic_clean_wq = create_singlethread_workqueue("nic_clean_wq");
-  if (!nic_clean_wq) {
-    PRINT_ERR("create_singlethread_workqueue nic_clean_wq failed\n");
-    return -ENOMEM;
-  }
+  num_queues = clamp_val(num_queues, 1, NIC_MAX_QUEUES);
 
   nic_uio_poll_wq = create_singlethread_workqueue("nic_uio_poll_wq");
   if (!nic_uio_poll_wq) {
@@ -169,7 +236,6 @@ static void __exit nic_exit_module(void) {
   nic_remove(NULL);
 #endif
 
-  destroy_workqueue(nic_clean_wq);
   destroy_workqueue(nic_uio_poll_wq);
 }
 
@@ -181,6 +247,7 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
   struct nic_adapter *adapter[NIC_IF_NUM];
   int err = 0;
   size_t i;
+  int q;
 #ifndef NO_PCI
   int bars;
 #endif
@@ -220,16 +287,42 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
   }
 
   for (i = 0; i < NIC_IF_NUM; i++) {
-    drvdata->netdevs[i] = alloc_etherdev(sizeof(struct nic_adapter));
-    adapter[i] = netdev_priv(drvdata->netdevs[i]);
+    drvdata->netdevs[i] =
+        alloc_etherdev_mq(sizeof(struct nic_adapter), num_queues);
     if (!drvdata->netdevs[i]) {
       PRINT_ERR("alloc_etherdev %zu failed\n", i);
       err = -ENOMEM;
       goto err_alloc_etherdev;
     }
+    adapter[i] = netdev_priv(drvdata->netdevs[i]);
 
     adapter[i]->netdev = drvdata->netdevs[i];
     adapter[i]->if_id = i;
+    adapter[i]->num_queues = num_queues;
+    adapter[i]->tx_ring_size = NIC_TX_RING_QUEUES;
+    adapter[i]->rx_ring_size = NIC_RX_RING_QUEUES;
+    adapter[i]->rx_max_frames = 1;
+    adapter[i]->tx_max_frames = NIC_TX_SYNC_THRESHOLD;
+    adapter[i]->rx_sync_num = NIC_RX_SYNC_NUM;
+    for (q = 0; q < num_queues; q++) {
+      struct nic_queue *queue = &adapter[i]->queues[q];
+
+      queue->adapter = adapter[i];
+      queue->id = q;
+      hrtimer_init(&queue->rx_mod_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+      queue->rx_mod_timer.function = nic_rx_mod_func;
+      hrtimer_init(&queue->tx_flush_timer, CLOCK_MONOTONIC,
+                   HRTIMER_MODE_REL_SOFT);
+      queue->tx_flush_timer.function = nic_tx_flush_func;
+      INIT_WORK(&queue->rx_dim.work, nic_rx_dim_work);
+      queue->rx_dim.mode = DIM_CQ_PERIOD_MODE_START_FROM_EQE;
+#ifndef NO_PCI
+      INIT_WORK(&adapter[i]->queues[q].uio_poll_work, nic_uio_poll_work);
+#endif
+#ifdef NO_INT
+      nic_emu_int_init(&adapter[i]->queues[q]);
+#endif
+    }
 #ifndef NO_PCI
     adapter[i]->pdev = pdev;
     adapter[i]->bars = bars;
@@ -245,7 +338,7 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
   pci_set_drvdata(pdev, drvdata);
 #endif
 
-#if defined(NO_PCI) || defined(NO_INT)
+#ifdef NO_PCI
   memmove(test_netdev, drvdata->netdevs, sizeof(void *) * NIC_IF_NUM);
 #endif
   PRINT_INFO("alloc netdev\n");
@@ -266,6 +359,12 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
     adapter[i]->io_base = adapter[0]->io_base;
     adapter[i]->io_addr = adapter[0]->io_addr + NIC_CTL_ADDR(0, i, 0);
   }
+  for (i = 0; i < NIC_IF_NUM; i++) {
+    for (q = 0; q < num_queues; q++) {
+      adapter[i]->queues[q].io_addr =
+          adapter[0]->io_addr + NIC_CTL_ADDR(0, NIC_QUEUE_CH(i, q), 0);
+    }
+  }
   PRINT_INFO("pci_ioremap\n");
 
   // dma
@@ -282,12 +381,34 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
     // char mac_addr[ETH_ALEN] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     drvdata->netdevs[i]->netdev_ops = &nic_netdev_ops;
     nic_set_ethtool_ops(drvdata->netdevs[i]);
+    // checksums and segmentation are done by the driver, see nic_tx_tso
+    drvdata->netdevs[i]->hw_features |=
+        NETIF_F_HW_CSUM | NETIF_F_RXCSUM | NETIF_F_RXHASH;
+    // frags and tso payloads go out on descriptors of their own, behind
+    // the header, joined by eop
+    if (hw_eop) {
+      drvdata->netdevs[i]->hw_features |=
+          NETIF_F_SG | NETIF_F_TSO | NETIF_F_TSO6;
+    }
+    drvdata->netdevs[i]->features |= drvdata->netdevs[i]->hw_features;
+#if !defined(NO_PCI) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    // redirect target only while up, see nic_xdp_set_target
+    xdp_set_features_flag(drvdata->netdevs[i],
+                          NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+                              NETDEV_XDP_ACT_XSK_ZEROCOPY);
+#endif
+    netif_set_tso_max_segs(drvdata->netdevs[i], NIC_TSO_MAX_SEGS);
+    // without eop every rx buffer is a frame of its own
+    drvdata->netdevs[i]->max_mtu = hw_eop ? NIC_MAX_MTU : NIC_BUF_MAX_MTU;
+    for (q = 0; q < num_queues; q++) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
-    netif_napi_add(drvdata->netdevs[i], &adapter[i]->napi, nic_poll);
+      netif_napi_add(drvdata->netdevs[i], &adapter[i]->queues[q].napi,
+                     nic_poll);
 #else
-    netif_napi_add(drvdata->netdevs[i], &adapter[i]->napi, nic_poll,
-                   NAPI_POLL_WEIGHT);
+      netif_napi_add(drvdata->netdevs[i], &adapter[i]->queues[q].napi,
+                     nic_poll, NAPI_POLL_WEIGHT);
 #endif
+    }
     // eth_hw_addr_set(netdev[i], adapter[i]->mac_addr);
     eth_hw_addr_random(drvdata->netdevs[i]);
   }
@@ -307,8 +428,10 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
 
 #ifndef NO_INT
   // irq
-  err = pci_alloc_irq_vectors(pdev, NIC_VEC_IF_SIZE * NIC_IF_NUM,
-                              NIC_VEC_IF_SIZE * NIC_IF_NUM, PCI_IRQ_MSI);
+  // one tx/rx vector pair per queue
+  err = pci_alloc_irq_vectors(pdev, NIC_VEC_IF_SIZE * NIC_IF_NUM * num_queues,
+                              NIC_VEC_IF_SIZE * NIC_IF_NUM * num_queues,
+                              PCI_IRQ_MSIX | PCI_IRQ_MSI);
   if (err < 0) {
     PRINT_ERR("pci_alloc_irq_vectors failed\n");
     goto err_alloc_irq_vectors;
@@ -316,25 +439,24 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
   PRINT_INFO("pci_alloc_irq_vectors\n");
 
   for (i = 0; i < NIC_IF_NUM; i++) {
-    adapter[i]->irq_tx = pci_irq_vector(pdev, NIC_VEC_IF_SIZE * i + NIC_VEC_TX);
-    err = request_irq(adapter[i]->irq_tx, nic_interrupt_tx, 0, nic_driver_name,
-                      drvdata->netdevs[i]);
-    if (err) {
-      PRINT_ERR("request_irq %zu nic_interrupt_tx failed\n", i);
-      goto err_request_irq;
-    }
-
-    adapter[i]->irq_rx = pci_irq_vector(pdev, NIC_VEC_IF_SIZE * i + NIC_VEC_RX);
-    err = request_irq(adapter[i]->irq_rx, nic_interrupt_rx, 0, nic_driver_name,
-                      drvdata->netdevs[i]);
-    if (err) {
-      PRINT_ERR("request_irq %zu nic_interrupt_rx failed\n", i);
-      goto err_request_irq;
-    }
-
-    if (err) {
-      PRINT_ERR("request_irq %zu nic_interrupt_other failed\n", i);
-      goto err_request_irq;
+    for (q = 0; q < num_queues; q++) {
+      struct nic_queue *queue = &adapter[i]->queues[q];
+
+      queue->irq_tx = pci_irq_vector(pdev, NIC_QUEUE_VEC(i, q, NIC_VEC_TX));
+      err = request_irq(queue->irq_tx, nic_interrupt_tx, 0, nic_driver_name,
+                        queue);
+      if (err) {
+        PRINT_ERR("request_irq %zu/%d nic_interrupt_tx failed\n", i, q);
+        goto err_request_irq;
+      }
+
+      queue->irq_rx = pci_irq_vector(pdev, NIC_QUEUE_VEC(i, q, NIC_VEC_RX));
+      err = request_irq(queue->irq_rx, nic_interrupt_rx, 0, nic_driver_name,
+                        queue);
+      if (err) {
+        PRINT_ERR("request_irq %zu/%d nic_interrupt_rx failed\n", i, q);
+        goto err_request_irq;
+      }
     }
   }
 #endif // NO_INT
@@ -355,14 +477,6 @@ static int nic_probe(struct pci_dev *pdev, const struct pci_device_id *ent) {
     goto err_cdev;
   }
 
-#endif
-
-#ifdef NO_INT
-  // emu int
-  emu_int_timer.expires = jiffies + NIC_EMU_INT_JIFFIES;
-  emu_int_timer.function = test_timer_func;
-  add_timer(&emu_int_timer);
-
 #endif
 
   PRINT_INFO("nic_probe done\n");
@@ -377,8 +491,10 @@ err_cdev:
 err_setup_all_resources:
 
   for (i = 0; i < NIC_IF_NUM; i++) {
-    free_irq(adapter[i]->irq_tx, drvdata->netdevs[i]);
-    free_irq(adapter[i]->irq_rx, drvdata->netdevs[i]);
+    for (q = 0; q < num_queues; q++) {
+      free_irq(adapter[i]->queues[q].irq_tx, &adapter[i]->queues[q]);
+      free_irq(adapter[i]->queues[q].irq_rx, &adapter[i]->queues[q]);
+    }
   }
 err_request_irq:
 
@@ -416,15 +532,19 @@ static void nic_remove(struct pci_dev *pdev) {
 #ifndef NO_PCI
   struct nic_adapter *adapter[NIC_IF_NUM];
 #endif
+#if !defined(NO_PCI) && !defined(NO_INT)
+  int q;
+#endif
 
   PRINT_INFO("nic_remove\n");
 
-#ifdef NO_INT
-  del_timer(&emu_int_timer);
-#endif
-
 #ifndef NO_PCI
   drvdata = pci_get_drvdata(pdev);
+#ifdef NO_INT
+  for (i = 0; i < NIC_IF_NUM; i++) {
+    nic_emu_int_stop(netdev_priv(drvdata->netdevs[i]));
+  }
+#endif
   for (i = 0; i < NIC_IF_NUM; i++) {
     adapter[i] = netdev_priv(drvdata->netdevs[i]);
     nic_free_all_resources(adapter[i]);
@@ -438,8 +558,10 @@ static void nic_remove(struct pci_dev *pdev) {
 #ifndef NO_PCI
 #ifndef NO_INT
   for (i = 0; i < NIC_IF_NUM; i++) {
-    free_irq(adapter[i]->irq_tx, drvdata->netdevs[i]);
-    free_irq(adapter[i]->irq_rx, drvdata->netdevs[i]);
+    for (q = 0; q < adapter[i]->num_queues; q++) {
+      free_irq(adapter[i]->queues[q].irq_tx, &adapter[i]->queues[q]);
+      free_irq(adapter[i]->queues[q].irq_rx, &adapter[i]->queues[q]);
+    }
   }
   pci_free_irq_vectors(pdev);
   PRINT_INFO("free_irq\n");
@@ -585,12 +707,13 @@ static void nic_io_resume(struct pci_dev *pdev) {}
 
 // resource management
 
-static int nic_alloc_queues(struct nic_adapter *adapter) {
+static int nic_alloc_queue(struct nic_queue *queue) {
+  struct nic_adapter *adapter = queue->adapter;
 #ifndef NO_PCI
   struct pci_dev *pdev = adapter->pdev;
 #endif
-  struct nic_tx_ring *tx_ring = &adapter->tx_ring;
-  struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
   int err = 0;
   // struct nic_bd *tx_bd_va;
   // dma_addr_t *tx_bd_pa;
@@ -603,15 +726,16 @@ static int nic_alloc_queues(struct nic_adapter *adapter) {
   size_t i;
 #ifndef NO_PCI
   dma_addr_t rx_buffer_pa;
+  struct page_pool_params pp_params = {};
 #endif
 
   // TX
-  tx_ring->bd_size = NIC_TX_RING_QUEUES;
+  tx_ring->bd_size = adapter->tx_ring_size;
 
-  tx_ring->skbs =
-      kcalloc(tx_ring->bd_size, sizeof(struct sk_buff *), GFP_KERNEL);
-  if (!tx_ring->skbs) {
-    PRINT_ERR("alloc tx_ring skbs failed\n");
+  tx_ring->buffers =
+      kcalloc(tx_ring->bd_size, sizeof(struct nic_tx_buffer), GFP_KERNEL);
+  if (!tx_ring->buffers) {
+    PRINT_ERR("alloc tx_ring buffers failed\n");
     err = -ENOMEM;
     goto err_tx;
   }
@@ -634,9 +758,50 @@ static int nic_alloc_queues(struct nic_adapter *adapter) {
     goto err_tx_bd;
   }
 
+  // TX TSO headers
+  // written by nic_tx_tso, the slot of the header descriptor picks the entry
+
+#ifndef NO_PCI
+  tx_ring->tso_hdrs = dma_alloc_coherent(
+      &pdev->dev, TSO_HEADER_SIZE * tx_ring->bd_size, &tx_ring->tso_hdrs_pa,
+      GFP_KERNEL);
+  if (!tx_ring->tso_hdrs) {
+    PRINT_ERR("alloc tx_ring tso headers failed\n");
+    err = -ENOMEM;
+    goto err_tx_tso;
+  }
+#endif
+
+  // TX uio buffer
+  // contiguous, mapped by userspace, only the raw cdev queue has one
+
+  if (queue->id == NIC_UIO_QUEUE) {
+#ifndef NO_PCI
+    tx_ring->uio_data_va = dma_alloc_coherent(
+        &pdev->dev, sizeof(struct nic_tx_frame) * tx_ring->bd_size,
+        &tx_ring->uio_data_pa, GFP_KERNEL);
+#else
+    tx_ring->uio_data_va =
+        kcalloc(tx_ring->bd_size, sizeof(struct nic_tx_frame), GFP_KERNEL);
+#endif
+
+    if (!tx_ring->uio_data_va) {
+      PRINT_ERR("alloc tx_ring uio buffer failed\n");
+      err = -ENOMEM;
+      goto err_tx_uio_data;
+    }
+
+    tx_ring->uio_ctl = (void *)get_zeroed_page(GFP_KERNEL);
+    if (!tx_ring->uio_ctl) {
+      PRINT_ERR("alloc tx_ring uio ctl failed\n");
+      err = -ENOMEM;
+      goto err_tx_uio_ctl;
+    }
+  }
+
   // RX
 
-  rx_ring->bd_size = NIC_RX_RING_QUEUES;
+  rx_ring->bd_size = adapter->rx_ring_size;
 
   rx_data_vas =
       kcalloc(rx_ring->bd_size, sizeof(struct nic_rx_frame *), GFP_KERNEL);
@@ -667,6 +832,10 @@ static int nic_alloc_queues(struct nic_adapter *adapter) {
     goto err_rx_buffer;
   }
 
+  rx_ring->data_va = rx_data_va;
+#ifndef NO_PCI
+  rx_ring->data_pa = rx_buffer_pa;
+#endif
   for (i = 0; i < rx_ring->bd_size; i++) {
     rx_data_vas[i] = rx_data_va + i;
   }
@@ -678,57 +847,169 @@ static int nic_alloc_queues(struct nic_adapter *adapter) {
 
   rx_ring->bd_va = dma_alloc_coherent(&pdev->dev, rx_ring->bd_dma_size,
                                       &rx_ring->bd_pa, GFP_KERNEL);
-  for (i = 0; i < rx_ring->bd_size; i++) {
-    rx_ring->bd_va[i].addr = rx_buffer_pa + sizeof(struct nic_rx_frame) * i;
-  }
 #else
   rx_ring->bd_va = kcalloc(rx_ring->size, sizeof(struct nic_bd), GFP_KERNEL);
 #endif
 
-  if (!rx_ring->data_vas) {
+  if (!rx_ring->bd_va) {
     PRINT_ERR("dma_alloc_coherent rx_ring bd failed\n");
     err = -ENOMEM;
     goto err_rx_bd;
   }
 
+#ifndef NO_PCI
+  for (i = 0; i < rx_ring->bd_size; i++) {
+    rx_ring->bd_va[i].addr = rx_buffer_pa + sizeof(struct nic_rx_frame) * i;
+  }
+#endif
+
+  // RX page pool
+  // slots are moved onto pool pages as napi hands them back to the device
+
+  rx_ring->pages = kcalloc(rx_ring->bd_size, sizeof(struct page *), GFP_KERNEL);
+  if (!rx_ring->pages) {
+    PRINT_ERR("alloc rx_ring pages failed\n");
+    err = -ENOMEM;
+    goto err_rx_pages;
+  }
+
+#ifndef NO_PCI
+  if (queue->xsk_pool) {
+    rx_ring->xsk_bufs =
+        kcalloc(rx_ring->bd_size, sizeof(struct xdp_buff *), GFP_KERNEL);
+    if (!rx_ring->xsk_bufs) {
+      PRINT_ERR("alloc rx_ring xsk_bufs failed\n");
+      err = -ENOMEM;
+      goto err_rx_xsk_bufs;
+    }
+  }
+
+  pp_params.order = 0;
+  pp_params.flags = PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV;
+  pp_params.pool_size = rx_ring->bd_size;
+  pp_params.nid = dev_to_node(&pdev->dev);
+  pp_params.dev = &pdev->dev;
+  // XDP_TX sends straight from the pool pages
+  pp_params.dma_dir = DMA_BIDIRECTIONAL;
+  pp_params.offset = NIC_RX_HEADROOM;
+  pp_params.max_len = NIC_RX_PKT_SIZE;
+  rx_ring->page_pool = page_pool_create(&pp_params);
+  if (IS_ERR(rx_ring->page_pool)) {
+    PRINT_ERR("page_pool_create failed\n");
+    err = PTR_ERR(rx_ring->page_pool);
+    rx_ring->page_pool = NULL;
+    goto err_rx_pool;
+  }
+
+  err = xdp_rxq_info_reg(&queue->xdp_rxq, adapter->netdev, queue->id,
+                         queue->napi.napi_id);
+  if (err) {
+    PRINT_ERR("xdp_rxq_info_reg failed\n");
+    goto err_rx_xdp;
+  }
+  // zero copy queues hand out umem buffers instead of pool pages
+  if (queue->xsk_pool) {
+    err = xdp_rxq_info_reg_mem_model(&queue->xdp_rxq, MEM_TYPE_XSK_BUFF_POOL,
+                                     NULL);
+  } else {
+    err = xdp_rxq_info_reg_mem_model(&queue->xdp_rxq, MEM_TYPE_PAGE_POOL,
+                                     rx_ring->page_pool);
+  }
+  if (err) {
+    PRINT_ERR("xdp_rxq_info_reg_mem_model failed\n");
+    xdp_rxq_info_unreg(&queue->xdp_rxq);
+    goto err_rx_xdp;
+  }
+  if (queue->xsk_pool) {
+    xsk_pool_set_rxq_info(queue->xsk_pool, &queue->xdp_rxq);
+  }
+#endif
+
   // check_64k_bound
   // TODO
 
 #ifndef NO_PCI
   // write reg
-  nic_set_hw(adapter);
+  nic_set_hw(queue);
 
   // sync_with_hw_tail
   tx_ring->next_to_use =
-      readl(adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_TAIL));
+      readl(queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_TX_BD_TAIL));
   tx_ring->last_sync = tx_ring->next_to_use;
   tx_ring->next_to_clean = tx_ring->next_to_use;
-  netdev_info(adapter->netdev, "tx_ring->next_to_use: %u\n",
-              tx_ring->next_to_use);
+  if (tx_ring->uio_ctl) {
+    tx_ring->uio_ctl->next_to_use = tx_ring->next_to_use;
+    tx_ring->uio_ctl->next_to_clean = tx_ring->next_to_clean;
+  }
+  netdev_info(adapter->netdev, "queue %u: tx_ring->next_to_use: %u\n",
+              queue->id, tx_ring->next_to_use);
 
   rx_ring->next_to_use =
-      readl(adapter->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_TAIL));
-  netdev_info(adapter->netdev, "rx_ring->next_to_use: %u\n",
-              rx_ring->next_to_use);
-  rx_ring->last_sync = rx_ring->next_to_use + NIC_RX_SYNC_NUM;
-  nic_update_rx_tail(adapter);
+      readl(queue->io_addr + NIC_REG_TO_ADDR(NIC_PCIE_REG_RX_BD_TAIL));
+  netdev_info(adapter->netdev, "queue %u: rx_ring->next_to_use: %u\n",
+              queue->id, rx_ring->next_to_use);
+  rx_ring->next_to_clean = rx_ring->next_to_use;
+  rx_ring->last_sync =
+      NIC_RING_WRAP(rx_ring, rx_ring->next_to_use + adapter->rx_sync_num);
+  nic_update_rx_tail(queue);
 #endif
 
   return 0;
 
+#ifndef NO_PCI
+err_rx_xdp:
+  page_pool_destroy(rx_ring->page_pool);
+  rx_ring->page_pool = NULL;
+
+err_rx_pool:
+  kfree(rx_ring->xsk_bufs);
+  rx_ring->xsk_bufs = NULL;
+
+err_rx_xsk_bufs:
+#endif
+  kfree(rx_ring->pages);
+
+err_rx_pages:
+#ifndef NO_PCI
+  dma_free_coherent(&pdev->dev, rx_ring->bd_dma_size, rx_ring->bd_va,
+                    rx_ring->bd_pa);
+#else
+  kfree(rx_ring->bd_va);
+#endif
+
 err_rx_bd:
 #ifndef NO_PCI
   dma_free_coherent(&pdev->dev, sizeof(struct nic_rx_frame) * rx_ring->bd_size,
-                    rx_ring->data_vas[0], rx_ring->bd_va[0].addr);
+                    rx_ring->data_va, rx_ring->data_pa);
 #else
-  kfree(rx_ring->data_vas[0]);
+  kfree(rx_ring->data_va);
 #endif
 
 err_rx_buffer:
   kfree(rx_ring->data_vas);
 
 err_rx:
+  free_page((unsigned long)tx_ring->uio_ctl);
+  tx_ring->uio_ctl = NULL;
+
+err_tx_uio_ctl:
+  if (tx_ring->uio_data_va) {
+#ifndef NO_PCI
+    dma_free_coherent(&pdev->dev,
+                      sizeof(struct nic_tx_frame) * tx_ring->bd_size,
+                      tx_ring->uio_data_va, tx_ring->uio_data_pa);
+#else
+    kfree(tx_ring->uio_data_va);
+#endif
+    tx_ring->uio_data_va = NULL;
+  }
+
+err_tx_uio_data:
 #ifndef NO_PCI
+  dma_free_coherent(&pdev->dev, TSO_HEADER_SIZE * tx_ring->bd_size,
+                    tx_ring->tso_hdrs, tx_ring->tso_hdrs_pa);
+
+err_tx_tso:
   dma_free_coherent(&pdev->dev, tx_ring->bd_dma_size, tx_ring->bd_va,
                     tx_ring->bd_pa);
 #else
@@ -737,48 +1018,209 @@ err_rx:
 #endif
 
 err_tx_bd:
-  kfree(tx_ring->skbs);
+  kfree(tx_ring->buffers);
 
 err_tx:
+  // nothing left for nic_free_queue
+  tx_ring->bd_size = 0;
+  rx_ring->bd_size = 0;
   return err;
 }
 
-static int nic_free_queues(struct nic_adapter *adapter) {
-  struct nic_tx_ring *tx_ring = &adapter->tx_ring;
-  struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+#ifndef NO_PCI
+static void nic_tx_unmap(struct nic_queue *queue, struct nic_tx_buffer *buf) {
+  struct device *dev = &queue->adapter->pdev->dev;
+
+  if (!buf->len) {
+    return;
+  }
+  if (buf->page) {
+    dma_unmap_page(dev, buf->dma, buf->len, DMA_TO_DEVICE);
+  } else {
+    dma_unmap_single(dev, buf->dma, buf->len, DMA_TO_DEVICE);
+  }
+  buf->len = 0;
+}
+#endif
 
+static void nic_free_queue(struct nic_queue *queue) {
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
 #ifndef NO_PCI
-  struct pci_dev *pdev = adapter->pdev;
+  struct pci_dev *pdev = queue->adapter->pdev;
+#endif
+  size_t i;
+
+  // a failed resize left the queue without rings
+  if (!tx_ring->bd_size) {
+    return;
+  }
+
+#ifndef NO_PCI
+  // nic_close only masks the vectors, the device still owns rx bds that
+  // point at pool pages and xsk buffers
+  cancel_work_sync(&queue->uio_poll_work);
+  nic_unset_hw(queue);
+#endif
+
+  // its frags go back to the pool before it is destroyed
+  if (queue->rx_skb) {
+    dev_kfree_skb_any(queue->rx_skb);
+    queue->rx_skb = NULL;
+  }
+  queue->rx_discard = false;
+  for (i = 0; i < rx_ring->bd_size; i++) {
+    if (rx_ring->pages[i]) {
+      page_pool_put_full_page(rx_ring->page_pool, rx_ring->pages[i], false);
+    }
+    if (rx_ring->xsk_bufs && rx_ring->xsk_bufs[i]) {
+      xsk_buff_free(rx_ring->xsk_bufs[i]);
+    }
+  }
+  kfree(rx_ring->xsk_bufs);
+  rx_ring->xsk_bufs = NULL;
+  // drops the reference of the mem model, the pool follows
+  if (xdp_rxq_info_is_reg(&queue->xdp_rxq)) {
+    xdp_rxq_info_unreg(&queue->xdp_rxq);
+  }
+  page_pool_destroy(rx_ring->page_pool);
+  rx_ring->page_pool = NULL;
+  kfree(rx_ring->pages);
 
-  nic_unset_hw(adapter);
+#ifndef NO_PCI
+  // skbs and xdp frames the device never completed
+  for (i = 0; i < tx_ring->bd_size; i++) {
+    if (tx_ring->buffers[i].xsk) {
+      xsk_tx_completed(queue->xsk_pool, 1);
+      tx_ring->buffers[i].xsk = false;
+    }
+    nic_tx_unmap(queue, &tx_ring->buffers[i]);
+    if (tx_ring->buffers[i].skb) {
+      dev_kfree_skb_any(tx_ring->buffers[i].skb);
+    }
+    if (tx_ring->buffers[i].xdpf) {
+      xdp_return_frame(tx_ring->buffers[i].xdpf);
+      tx_ring->buffers[i].xdpf = NULL;
+    }
+  }
+  netdev_tx_reset_queue(netdev_get_tx_queue(queue->adapter->netdev, queue->id));
 
   dma_free_coherent(&pdev->dev, sizeof(struct nic_rx_frame) * rx_ring->bd_size,
-                    rx_ring->data_vas[0], rx_ring->bd_va[0].addr);
+                    rx_ring->data_va, rx_ring->data_pa);
   dma_free_coherent(&pdev->dev, rx_ring->bd_dma_size, rx_ring->bd_va,
                     rx_ring->bd_pa);
   kfree(rx_ring->data_vas);
 
+  free_page((unsigned long)tx_ring->uio_ctl);
+  if (tx_ring->uio_data_va) {
+    dma_free_coherent(&pdev->dev,
+                      sizeof(struct nic_tx_frame) * tx_ring->bd_size,
+                      tx_ring->uio_data_va, tx_ring->uio_data_pa);
+  }
+  dma_free_coherent(&pdev->dev, TSO_HEADER_SIZE * tx_ring->bd_size,
+                    tx_ring->tso_hdrs, tx_ring->tso_hdrs_pa);
   dma_free_coherent(&pdev->dev, tx_ring->bd_dma_size, tx_ring->bd_va,
                     tx_ring->bd_pa);
-  kfree(tx_ring->skbs);
+  kfree(tx_ring->buffers);
 #else
-  kfree(rx_ring->data_vas[0]);
+  kfree(rx_ring->data_va);
   kfree(rx_ring->bd_va);
   kfree(rx_ring->data_vas);
 
+  free_page((unsigned long)tx_ring->uio_ctl);
+  kfree(tx_ring->uio_data_va);
   kfree(tx_ring->bd_va);
-  kfree(tx_ring->skbs);
+  kfree(tx_ring->buffers);
 #endif
 
+  tx_ring->uio_ctl = NULL;
+  tx_ring->uio_data_va = NULL;
   tx_ring->bd_size = 0;
   // tx_ring->size = 0;
   rx_ring->bd_size = 0;
   // rx_ring->size = 0;
+}
+
+static int nic_alloc_queues(struct nic_adapter *adapter) {
+  int err;
+  int q;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    err = nic_alloc_queue(&adapter->queues[q]);
+    if (err) {
+      netdev_err(adapter->netdev, "alloc queue %d failed\n", q);
+      goto err_alloc_queue;
+    }
+  }
   return 0;
+
+err_alloc_queue:
+  while (q--) {
+    nic_free_queue(&adapter->queues[q]);
+  }
+  return err;
+}
+
+static int nic_free_queues(struct nic_adapter *adapter) {
+  int q;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    nic_free_queue(&adapter->queues[q]);
+  }
+  return 0;
+}
+
+static void nic_free_rss(struct nic_adapter *adapter) {
+  struct nic_rss_ctx *ctx;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    ctx = per_cpu_ptr(adapter->rss, cpu);
+    netif_napi_del(&ctx->napi);
+    skb_queue_purge(&ctx->backlog);
+  }
+  free_percpu(adapter->rss);
+  adapter->rss = NULL;
 }
 
 int nic_setup_all_resources(struct nic_adapter *adapter) {
+  struct nic_rss_ctx *ctx;
   int err = 0;
+  int cpu;
+  int q;
+
+  // counters outlive ring resizes
+  for (q = 0; q < adapter->num_queues; q++) {
+    adapter->queues[q].stats = netdev_alloc_pcpu_stats(struct nic_queue_stats);
+    if (!adapter->queues[q].stats) {
+      PRINT_ERR("alloc queue %d stats failed\n", q);
+      err = -ENOMEM;
+      goto err_alloc_stats;
+    }
+  }
+
+  adapter->rss = alloc_percpu(struct nic_rss_ctx);
+  if (!adapter->rss) {
+    PRINT_ERR("alloc rss contexts failed\n");
+    err = -ENOMEM;
+    goto err_alloc_rss;
+  }
+  for_each_possible_cpu(cpu) {
+    ctx = per_cpu_ptr(adapter->rss, cpu);
+    skb_queue_head_init(&ctx->backlog);
+    INIT_CSD(&ctx->csd, nic_rss_ipi, ctx);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    netif_napi_add(adapter->netdev, &ctx->napi, nic_rss_poll);
+#else
+    netif_napi_add(adapter->netdev, &ctx->napi, nic_rss_poll,
+                   NAPI_POLL_WEIGHT);
+#endif
+  }
+  netdev_rss_key_fill(adapter->rss_key, NIC_RSS_KEY_SIZE);
+  for (q = 0; q < NIC_RSS_INDIR_SIZE; q++) {
+    adapter->rss_indir[q] = ethtool_rxfh_indir_default(q, num_online_cpus());
+  }
+
   err = nic_alloc_queues(adapter);
   if (err) {
     PRINT_ERR("nic_alloc_queues failed\n");
@@ -786,23 +1228,124 @@ int nic_setup_all_resources(struct nic_adapter *adapter) {
   }
 
   sema_init(&adapter->raw_sema, 1);
-  sema_init(&adapter->raw_rx_sema, 0);
-  sema_init(&adapter->raw_rx_wait_sema, 0);
+  init_waitqueue_head(&adapter->uio_tx_wait);
+  mutex_init(&adapter->uio_tx_lock);
+  INIT_LIST_HEAD(&adapter->uio_uring_rx);
+  INIT_LIST_HEAD(&adapter->uio_uring_tx);
+  spin_lock_init(&adapter->uio_uring_lock);
+  spin_lock_init(&adapter->uio_rx_lock);
+  RCU_INIT_POINTER(adapter->uio_rxq, NULL);
+  adapter->uio_rx_drops = 0;
+  atomic_set(&adapter->uio_rx_mmaps, 0);
+  atomic_set(&adapter->uio_mmaps, 0);
 
   return 0;
 
 err_alloc_queues:
+  nic_free_rss(adapter);
+err_alloc_rss:
+  q = adapter->num_queues;
+err_alloc_stats:
+  while (q--) {
+    free_percpu(adapter->queues[q].stats);
+    adapter->queues[q].stats = NULL;
+  }
   return err;
 }
 
 void nic_free_all_resources(struct nic_adapter *adapter) {
+  int q;
+
+  nic_free_queues(adapter);
+  nic_free_rss(adapter);
+  for (q = 0; q < adapter->num_queues; q++) {
+    free_percpu(adapter->queues[q].stats);
+    adapter->queues[q].stats = NULL;
+  }
+}
+
+// the raw port owner and its mappings point into the rings of the uio
+// queue. on success the caller holds raw_sema while it replaces them
+static int nic_raw_port_quiesce(struct nic_adapter *adapter, bool uio_queue) {
+  if (down_trylock(&adapter->raw_sema)) {
+    return -EBUSY;
+  }
+  if (uio_queue &&
+      (adapter->uio_enabled || atomic_read(&adapter->uio_mmaps))) {
+    up(&adapter->raw_sema);
+    return -EBUSY;
+  }
+  return 0;
+}
+
+// reallocate every ring pair with new sizes, called with rtnl held
+int nic_resize_rings(struct nic_adapter *adapter, u16 tx_size, u16 rx_size) {
+  struct net_device *netdev = adapter->netdev;
+  u16 old_tx_size = adapter->tx_ring_size;
+  u16 old_rx_size = adapter->rx_ring_size;
+  bool running = netif_running(netdev);
+  int err;
+  int open_err;
+
+  err = nic_raw_port_quiesce(adapter, true);
+  if (err) {
+    return err;
+  }
+
+  if (running) {
+    nic_close(netdev);
+  }
   nic_free_queues(adapter);
+
+  adapter->tx_ring_size = tx_size;
+  adapter->rx_ring_size = rx_size;
+  err = nic_alloc_queues(adapter);
+  if (err) {
+    netdev_err(netdev, "resize rings failed, keep %u/%u\n", old_tx_size,
+               old_rx_size);
+    adapter->tx_ring_size = old_tx_size;
+    adapter->rx_ring_size = old_rx_size;
+    if (nic_alloc_queues(adapter)) {
+      netdev_err(netdev, "restore rings failed\n");
+      netif_device_detach(netdev);
+      // nothing left to run on, nic_close sees it already closed
+      if (running) {
+        dev_close(netdev);
+      }
+      goto out;
+    }
+  }
+
+  if (running) {
+    open_err = nic_open(netdev);
+    if (!err) {
+      err = open_err;
+    }
+  }
+
+out:
+  up(&adapter->raw_sema);
+  return err;
 }
 
 // net device
 
+// devmap and bpf_redirect check NETDEV_XDP_ACT_NDO_XMIT, it is set while
+// nic_xdp_xmit can post to the rings. called with rtnl held
+static void nic_xdp_set_target(struct nic_adapter *adapter, bool on) {
+#if !defined(NO_PCI) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  if (on) {
+    xdp_features_set_redirect_target(adapter->netdev, false);
+  } else {
+    xdp_features_clear_redirect_target(adapter->netdev);
+  }
+#endif
+}
+
 int nic_open(struct net_device *netdev) {
   struct nic_adapter *adapter = netdev_priv(netdev);
+  int cpu;
+  int q;
   netdev_info(netdev, "nic_open\n");
 
   netif_carrier_off(netdev);
@@ -810,38 +1353,68 @@ int nic_open(struct net_device *netdev) {
   // test
   // return 0;
 
-  napi_enable(&adapter->napi);
+  for_each_possible_cpu(cpu) {
+    napi_enable(&per_cpu_ptr(adapter->rss, cpu)->napi);
+  }
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    napi_enable(&adapter->queues[q].napi);
 
 #ifndef NO_PCI
-  nic_set_int(adapter, NIC_VEC_TX, true);
-  nic_set_int(adapter, NIC_VEC_RX, true);
-  // nic_set_int(adapter, NIC_VEC_OTHER, true);
+    nic_set_int(&adapter->queues[q], NIC_VEC_TX, true);
+    nic_set_int(&adapter->queues[q], NIC_VEC_RX, true);
+    // nic_set_int(adapter, NIC_VEC_OTHER, true);
 #endif
+  }
 
-  netif_start_queue(netdev);
+  netif_tx_start_all_queues(netdev);
 
   netif_carrier_on(netdev);
   netdev_info(netdev, "netif_carrier_on\n");
+  // the raw cdev owns the rings in uio mode
+  nic_xdp_set_target(adapter, !adapter->uio_enabled);
 
   return 0;
 }
 
 int nic_close(struct net_device *netdev) {
   struct nic_adapter *adapter = netdev_priv(netdev);
+  int cpu;
+  int q;
   netdev_info(netdev, "nic_close\n");
 
   // test
   // return 0;
 
-#ifndef NO_PCI
-  nic_set_int(adapter, NIC_VEC_TX, false);
-  nic_set_int(adapter, NIC_VEC_RX, false);
-  // nic_set_int(adapter, NIC_VEC_OTHER, false);
-#endif
+  // a failed ring restore closed it and detached it for good
+  if (!netif_device_present(netdev)) {
+    return 0;
+  }
 
+  nic_xdp_set_target(adapter, false);
   netif_tx_disable(netdev);
   netif_carrier_off(netdev);
-  napi_disable(&adapter->napi);
+  for (q = 0; q < adapter->num_queues; q++) {
+    napi_disable(&adapter->queues[q].napi);
+    // napi is off, nothing re-arms the moderation timer
+    hrtimer_cancel(&adapter->queues[q].rx_mod_timer);
+    // tx is disabled, the flush has no batch left to wait for
+    hrtimer_cancel(&adapter->queues[q].tx_flush_timer);
+    cancel_work_sync(&adapter->queues[q].rx_dim.work);
+  }
+  // the rings are quiet, drop what is still waiting for a cpu
+  for_each_possible_cpu(cpu) {
+    napi_disable(&per_cpu_ptr(adapter->rss, cpu)->napi);
+    skb_queue_purge(&per_cpu_ptr(adapter->rss, cpu)->backlog);
+  }
+
+#ifndef NO_PCI
+  for (q = 0; q < adapter->num_queues; q++) {
+    nic_set_int(&adapter->queues[q], NIC_VEC_TX, false);
+    nic_set_int(&adapter->queues[q], NIC_VEC_RX, false);
+    // nic_set_int(adapter, NIC_VEC_OTHER, false);
+  }
+#endif
 
   return 0;
 }
@@ -852,8 +1425,8 @@ void print_ring(void) {
   size_t i;
   for (i = 0; i < NIC_IF_NUM; i++) {
     struct nic_adapter *adapter = netdev_priv(test_netdev[i]);
-    struct nic_tx_ring *tx_ring = &adapter->tx_ring;
-    struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+    struct nic_tx_ring *tx_ring = &adapter->queues[0].tx_ring;
+    struct nic_rx_ring *rx_ring = &adapter->queues[0].rx_ring;
 
     PRINT_INFO("if_id: %u\n", adapter->if_id);
     PRINT_INFO("tx_ring->size: %u\n", tx_ring->size);
@@ -874,8 +1447,8 @@ void test_copy_data(struct work_struct *work) {
   struct nic_adapter *dst = netdev_priv(netdev_dst);
   struct nic_adapter *src = netdev_priv(netdev_src);
 
-  struct nic_tx_ring *src_tx_ring = &src->tx_ring;
-  struct nic_rx_ring *dst_rx_ring = &dst->rx_ring;
+  struct nic_tx_ring *src_tx_ring = &src->queues[0].tx_ring;
+  struct nic_rx_ring *dst_rx_ring = &dst->queues[0].rx_ring;
 
   struct sk_buff *skb;
 
@@ -894,10 +1467,9 @@ void test_copy_data(struct work_struct *work) {
       break;
     }
 
-    memmove(frame->data, src_tx_ring->skbs[src_tx_ring->next_to_use]->data,
-            bd->len);
+    skb = src_tx_ring->buffers[src_tx_ring->next_to_use].skb;
+    memmove(frame->data, skb->data, bd->len);
 
-    skb = src_tx_ring->skbs[src_tx_ring->next_to_use];
     dev_kfree_skb_any(skb);
 
     // print_ring();
@@ -907,68 +1479,268 @@ void test_copy_data(struct work_struct *work) {
         (src_tx_ring->next_to_use + 1) % src_tx_ring->size;
   }
 
-  if (napi_schedule_prep(&dst->napi)) {
-    __napi_schedule(&dst->napi);
+  if (napi_schedule_prep(&dst->queues[0].napi)) {
+    __napi_schedule(&dst->queues[0].napi);
   }
 
   kfree(work_ctx);
 }
 #endif
 
-static netdev_tx_t nic_xmit_frame(struct sk_buff *skb,
-                                  struct net_device *netdev) {
-  struct nic_adapter *adapter = netdev_priv(netdev);
-  struct nic_tx_ring *tx_ring;
-  struct nic_bd *bd;
-  u16 next_to_use;
 #ifndef NO_PCI
-  struct pci_dev *pdev = adapter->pdev;
-#endif
+static void nic_tx_set_bd(struct nic_queue *queue, u16 slot, dma_addr_t dma,
+                          u32 len, bool eop) {
+  struct nic_bd *bd = &queue->tx_ring.bd_va[slot];
+
+  bd->addr = cpu_to_le64(dma);
+  bd->flags = cpu_to_le64(len | (eop ? NIC_BD_FLAG_EOP : 0));
+  trace_nic_xmit(queue, slot, len);
+}
+
+// copy a small frame into its tso_hdrs entry, a pending checksum is
+// computed by the same pass
+static void nic_tx_bounce(struct nic_queue *queue, struct sk_buff *skb) {
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  u16 slot = tx_ring->next_to_use;
+  char *data = tx_ring->tso_hdrs + slot * TSO_HEADER_SIZE;
+  int start;
+  __wsum csum;
+
+  if (skb->ip_summed == CHECKSUM_PARTIAL) {
+    start = skb_checksum_start_offset(skb);
+    skb_copy_bits(skb, 0, data, start);
+    csum = skb_copy_and_csum_bits(skb, start, data + start, skb->len - start);
+    *(__sum16 *)(data + start + skb->csum_offset) =
+        csum_fold(csum) ?: CSUM_MANGLED_0;
+  } else {
+    skb_copy_bits(skb, 0, data, skb->len);
+  }
+
+  tx_ring->buffers[slot].len = 0;
+  tx_ring->buffers[slot].skb = skb;
+  nic_tx_set_bd(queue, slot, tx_ring->tso_hdrs_pa + slot * TSO_HEADER_SIZE,
+                skb->len, true);
+  tx_ring->next_to_use = NIC_RING_WRAP(tx_ring, slot + 1);
+}
+
+// head and frags on consecutive descriptors, the skb sits on the eop slot
+static int nic_tx_map(struct nic_queue *queue, struct sk_buff *skb) {
+  struct device *dev = &queue->adapter->pdev->dev;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  unsigned int nr_frags = skb_shinfo(skb)->nr_frags;
+  u16 first = tx_ring->next_to_use;
+  u16 slot = first;
+  struct nic_tx_buffer *buf;
+  const skb_frag_t *frag;
+  dma_addr_t dma;
+  unsigned int f;
+  u32 len;
+
+  for (f = 0; f <= nr_frags; f++) {
+    if (!f) {
+      len = skb_headlen(skb);
+      dma = dma_map_single(dev, skb->data, len, DMA_TO_DEVICE);
+    } else {
+      frag = &skb_shinfo(skb)->frags[f - 1];
+      len = skb_frag_size(frag);
+      dma = skb_frag_dma_map(dev, frag, 0, len, DMA_TO_DEVICE);
+    }
+    if (dma_mapping_error(dev, dma)) {
+      goto err_map;
+    }
+
+    buf = &tx_ring->buffers[slot];
+    buf->dma = dma;
+    buf->len = len;
+    buf->page = f;
+    nic_tx_set_bd(queue, slot, dma, len, f == nr_frags);
+    slot = NIC_RING_WRAP(tx_ring, slot + 1);
+  }
+
+  tx_ring->buffers[NIC_RING_WRAP(tx_ring, slot - 1)].skb = skb;
+  tx_ring->next_to_use = slot;
+  return 0;
+
+err_map:
+  while (slot != first) {
+    slot = NIC_RING_WRAP(tx_ring, slot - 1);
+    nic_tx_unmap(queue, &tx_ring->buffers[slot]);
+  }
+  return -ENOMEM;
+}
+
+// the device does no checksum offload, fill in the tcp checksum of a
+// segment built by tso_build_hdr, csum covers its payload
+static void nic_tso_csum(struct tso_t *tso, struct sk_buff *skb, char *hdr,
+                         int len, __wsum csum) {
+  struct tcphdr *th = (struct tcphdr *)(hdr + skb_transport_offset(skb));
+  int tcp_len = tso->tlen + len;
+
+  th->check = 0;
+  csum = csum_add(csum_partial(th, tso->tlen, 0), csum);
+  if (tso->ipv6) {
+    struct ipv6hdr *ip6h = (struct ipv6hdr *)(hdr + skb_network_offset(skb));
+
+    th->check = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, tcp_len,
+                                IPPROTO_TCP, csum);
+  } else {
+    struct iphdr *iph = (struct iphdr *)(hdr + skb_network_offset(skb));
+
+    ip_send_check(iph);
+    th->check = csum_tcpudp_magic(iph->saddr, iph->daddr, tcp_len,
+                                  IPPROTO_TCP, csum);
+  }
+}
+
+// segment a gso skb onto the ring, headers go to tso_hdrs and payload
+// descriptors point into the skb, the skb sits on the last eop slot
+static int nic_tx_tso(struct nic_queue *queue, struct sk_buff *skb) {
+  struct device *dev = &queue->adapter->pdev->dev;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  u16 first = tx_ring->next_to_use;
+  u16 slot = first;
+  struct nic_tx_buffer *buf;
+  struct tso_t tso;
+  int hdr_len, total_len, data_left, size, off;
+  dma_addr_t dma;
+  __wsum csum;
+  char *hdr;
+
+  hdr_len = tso_start(skb, &tso);
+  total_len = skb->len - hdr_len;
+  while (total_len > 0) {
+    data_left = min_t(int, skb_shinfo(skb)->gso_size, total_len);
+    total_len -= data_left;
+
+    // header, coherent, nothing to unmap
+    hdr = tx_ring->tso_hdrs + slot * TSO_HEADER_SIZE;
+    tso_build_hdr(skb, hdr, &tso, data_left, total_len == 0);
+    tx_ring->buffers[slot].len = 0;
+    nic_tx_set_bd(queue, slot, tx_ring->tso_hdrs_pa + slot * TSO_HEADER_SIZE,
+                  hdr_len, false);
+    slot = NIC_RING_WRAP(tx_ring, slot + 1);
+
+    csum = 0;
+    off = 0;
+    while (data_left > 0) {
+      size = min_t(int, tso.size, data_left);
+      dma = dma_map_single(dev, tso.data, size, DMA_TO_DEVICE);
+      if (dma_mapping_error(dev, dma)) {
+        goto err_map;
+      }
+      csum = csum_block_add(csum, csum_partial(tso.data, size, 0), off);
+      off += size;
+      data_left -= size;
+
+      buf = &tx_ring->buffers[slot];
+      buf->dma = dma;
+      buf->len = size;
+      buf->page = false;
+      nic_tx_set_bd(queue, slot, dma, size, !data_left);
+      slot = NIC_RING_WRAP(tx_ring, slot + 1);
+      tso_build_data(skb, &tso, size);
+    }
+    nic_tso_csum(&tso, skb, hdr, off, csum);
+  }
+
+  tx_ring->buffers[NIC_RING_WRAP(tx_ring, slot - 1)].skb = skb;
+  tx_ring->next_to_use = slot;
+  return 0;
+
+err_map:
+  while (slot != first) {
+    slot = NIC_RING_WRAP(tx_ring, slot - 1);
+    nic_tx_unmap(queue, &tx_ring->buffers[slot]);
+  }
+  return -ENOMEM;
+}
+#endif
+
+static netdev_tx_t nic_xmit_frame(struct sk_buff *skb,
+                                  struct net_device *netdev) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  struct nic_queue *queue;
+  struct nic_tx_ring *tx_ring;
+  struct netdev_queue *txq;
+  int descs;
+#ifndef NO_PCI
+  int err = 0;
+  u16 pending;
+  u32 usecs;
+#else
+  struct nic_bd *bd;
+  u16 next_to_use;
+#endif
+
+  // the stack picked the queue and holds its tx lock
+  queue = &adapter->queues[skb_get_queue_mapping(skb)];
+  txq = netdev_get_tx_queue(netdev, queue->id);
 
   if (adapter->uio_enabled) {
     // ignore skb
     dev_kfree_skb_any(skb);
+    NIC_STATS_INC(queue, tx_dropped);
     return NETDEV_TX_OK;
   }
 
-  netdev_info(netdev, "nic_xmit_frame\n");
-  netdev_info(netdev, "skb->len: %u\n", skb->len);
-
-  /* This goes back to the question of how to logically map a Tx queue
-   * to a flow.  Right now, performance is impacted slightly negatively
-   * if using multiple Tx queues.  If the stack breaks away from a
-   * single qdisc implementation, we can look at this again.
-   */
-  tx_ring = &adapter->tx_ring;
-  next_to_use = tx_ring->next_to_use;
-  bd = tx_ring->bd_va + next_to_use;
-
+  tx_ring = &queue->tx_ring;
+  descs = skb_is_gso(skb) ? tso_count_descs(skb)
+                          : skb_shinfo(skb)->nr_frags + 1;
+  // the queue is stopped before this can happen
+  if (unlikely(nic_uio_tx_free(tx_ring) < descs)) {
+    netif_tx_stop_queue(txq);
+    NIC_STATS_INC(queue, tx_ring_full);
+    return NETDEV_TX_BUSY;
+  }
   /* On PCI/PCI-X HW, if packet size is less than ETH_ZLEN,
    * packets may get corrupted during padding by HW.
    * To WA this issue, pad all small packets manually.
    */
   if (eth_skb_pad(skb)) {
-    netdev_err(netdev, "eth_skb_pad failed\n");
+    NIC_STATS_INC(queue, tx_dropped);
     return NETDEV_TX_OK;
   }
 
-  // dev_kfree_skb_any(skb);
-  // return NETDEV_TX_OK;
-
-  // mss
-  // TODO
-  bd->len = cpu_to_le16(skb->len);
-  tx_ring->skbs[next_to_use] = skb;
 #ifndef NO_PCI
-  bd->addr = cpu_to_le64(dma_map_single(
-      &pdev->dev, tx_ring->skbs[next_to_use]->data, skb->len, DMA_TO_DEVICE));
-  netdev_info(netdev, "bd->addr: %llx\n", bd->addr);
+  // the device only sends what it is given, checksums are done here
+  if (skb_is_gso(skb)) {
+    err = nic_tx_tso(queue, skb);
+  } else if (skb->len <= TSO_HEADER_SIZE) {
+    nic_tx_bounce(queue, skb);
+  } else if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+    err = -EINVAL;
+  } else {
+    err = nic_tx_map(queue, skb);
+  }
+  if (err) {
+    dev_kfree_skb_any(skb);
+    NIC_STATS_INC(queue, tx_dropped);
+    return NETDEV_TX_OK;
+  }
 #else
   // use va as pa, for test
+  next_to_use = tx_ring->next_to_use;
+  bd = tx_ring->bd_va + next_to_use;
+  bd->len = cpu_to_le16(skb->len);
   bd->addr = (dma_addr_t)NULL;
+  tx_ring->buffers[next_to_use].skb = skb;
+  tx_ring->next_to_use = NIC_RING_WRAP(tx_ring, next_to_use + 1);
 #endif
-
-  tx_ring->next_to_use = (next_to_use + 1) % tx_ring->bd_size;
+  NIC_STATS_ADD(queue, tx_packets,
+                skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1);
+  NIC_STATS_ADD(queue, tx_bytes, skb->len);
+  netdev_tx_sent_queue(txq, skb->len);
+
+  // stop while the next skb still fits, nic_clean_tx_ring wakes the queue
+  if (unlikely(nic_uio_tx_free(tx_ring) < NIC_TX_DESC_NEEDED)) {
+    netif_tx_stop_queue(txq);
+    NIC_STATS_INC(queue, tx_ring_full);
+    // pairs with the barrier in nic_clean_tx_ring
+    smp_mb();
+    if (nic_uio_tx_free(tx_ring) >= NIC_TX_WAKE_THRESHOLD) {
+      netif_tx_start_queue(txq);
+    }
+  }
 #ifndef NO_PCI
   /* Force memory writes to complete before letting h/w
    * know there are new descriptors to fetch.  (Only
@@ -977,12 +1749,20 @@ static netdev_tx_t nic_xmit_frame(struct sk_buff *skb,
    */
   // dma_wmb();
 
-  // TODO
-  if (!netdev_xmit_more() ||
-      netif_xmit_stopped(netdev_get_tx_queue(netdev, 0)) ||
-      ((tx_ring->next_to_use + tx_ring->bd_size - tx_ring->last_sync) %
-       tx_ring->bd_size) >= NIC_TX_SYNC_THRESHOLD) {
-    nic_update_tx_tail(adapter);
+  pending = NIC_RING_WRAP(tx_ring, tx_ring->next_to_use - tx_ring->last_sync);
+  // a queue stopped by us or by bql gets its batch now
+  if (pending >= READ_ONCE(adapter->tx_max_frames) ||
+      netif_xmit_stopped(txq)) {
+    nic_update_tx_tail(queue);
+  } else if (!netdev_xmit_more()) {
+    // no more skbs for now, bound the wait of the partial batch
+    usecs = READ_ONCE(adapter->tx_coalesce_usecs);
+    if (!usecs) {
+      nic_update_tx_tail(queue);
+    } else if (!hrtimer_is_queued(&queue->tx_flush_timer)) {
+      hrtimer_start(&queue->tx_flush_timer, us_to_ktime(usecs),
+                    HRTIMER_MODE_REL_SOFT);
+    }
   }
 
 #else
@@ -1013,40 +1793,715 @@ static netdev_tx_t nic_xmit_frame(struct sk_buff *skb,
   return NETDEV_TX_OK;
 }
 
-static struct sk_buff *nic_receive_skb(struct nic_adapter *adapter) {
-  struct net_device *netdev = adapter->netdev;
+// rx buffers
+
+static void nic_rx_set_coherent(struct nic_rx_ring *rx_ring, u16 slot) {
+  rx_ring->pages[slot] = NULL;
+  rx_ring->data_vas[slot] = (struct nic_rx_frame *)rx_ring->data_va + slot;
+  rx_ring->bd_va[slot].addr =
+      cpu_to_le64(rx_ring->data_pa + sizeof(struct nic_rx_frame) * slot);
+}
+
+// napi slots get a pool page, raw cdev slots the coherent frame
+static void nic_rx_refill(struct nic_queue *queue, u16 slot, bool use_pool) {
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  struct page *page = rx_ring->pages[slot];
+  struct xdp_buff *xdp;
+
+  BUILD_BUG_ON(NIC_RX_HEADROOM + NIC_RX_PKT_SIZE +
+                   SKB_DATA_ALIGN(sizeof(struct skb_shared_info)) >
+               PAGE_SIZE);
+
+  // zero copy queues post umem buffers, the coherent frame stays while
+  // the fill ring is empty
+  if (use_pool && queue->xsk_pool) {
+    if (rx_ring->xsk_bufs[slot]) {
+      return;
+    }
+    xdp = xsk_buff_alloc(queue->xsk_pool);
+    if (!xdp) {
+      if (xsk_uses_need_wakeup(queue->xsk_pool)) {
+        xsk_set_rx_need_wakeup(queue->xsk_pool);
+      }
+      return;
+    }
+    if (xsk_uses_need_wakeup(queue->xsk_pool)) {
+      xsk_clear_rx_need_wakeup(queue->xsk_pool);
+    }
+    rx_ring->xsk_bufs[slot] = xdp;
+    rx_ring->bd_va[slot].addr = cpu_to_le64(xsk_buff_xdp_get_dma(xdp));
+    return;
+  }
+
+  if (use_pool && !page && rx_ring->page_pool) {
+    // keep the coherent frame when the pool runs dry
+    page = page_pool_dev_alloc_pages(rx_ring->page_pool);
+    if (!page) {
+      return;
+    }
+    rx_ring->pages[slot] = page;
+    rx_ring->data_vas[slot] = page_address(page) + NIC_RX_HEADROOM;
+    rx_ring->bd_va[slot].addr =
+        cpu_to_le64(page_pool_get_dma_addr(page) + NIC_RX_HEADROOM);
+  } else if (!use_pool && page) {
+    page_pool_put_full_page(rx_ring->page_pool, page, false);
+    nic_rx_set_coherent(rx_ring, slot);
+  }
+}
+
+// refill the next rx_sync_num slots and move last_sync over them,
+// the caller writes the tail
+static void nic_rx_post_sync(struct nic_queue *queue, bool use_pool) {
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  u16 num = READ_ONCE(queue->adapter->rx_sync_num);
+  u16 i;
+
+  for (i = 0; i < num; i++) {
+    nic_rx_refill(queue, NIC_RING_WRAP(rx_ring, rx_ring->last_sync + i),
+                  use_pool);
+  }
+  rx_ring->last_sync = NIC_RING_WRAP(rx_ring, rx_ring->last_sync + num);
+}
+
+static void nic_rx_sync_for_cpu(struct nic_queue *queue, u16 slot, u16 len) {
+  struct page *page = queue->rx_ring.pages[slot];
+
+  if (page) {
+    dma_sync_single_range_for_cpu(
+        &queue->adapter->pdev->dev, page_pool_get_dma_addr(page),
+        NIC_RX_HEADROOM, len, page_pool_get_dma_dir(queue->rx_ring.page_pool));
+  }
+}
+
+// take the buffer of slot as a pool page, data at NIC_RX_HEADROOM
+static struct page *nic_rx_take_page(struct nic_queue *queue, u16 slot,
+                                     u16 len) {
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  struct page *page = rx_ring->pages[slot];
+
+  if (page) {
+    nic_rx_sync_for_cpu(queue, slot, len);
+    nic_rx_set_coherent(rx_ring, slot);
+    return page;
+  }
+  // the coherent frame stays on the ring, copy it into a pool page
+  page = rx_ring->page_pool ? page_pool_dev_alloc_pages(rx_ring->page_pool)
+                            : NULL;
+  if (page) {
+    memcpy(page_address(page) + NIC_RX_HEADROOM, rx_ring->data_vas[slot],
+           len);
+  }
+  return page;
+}
+
+#ifndef NO_PCI
+// xdp
+
+#define NIC_XDP_TX BIT(0)
+#define NIC_XDP_REDIR BIT(1)
+
+// post one frame under the txq lock, the caller rings the doorbell.
+// XDP_TX frames sit in our own pool pages, which are already mapped
+static int nic_xdp_post(struct nic_queue *queue, struct netdev_queue *txq,
+                        struct xdp_frame *xdpf, bool xdp_tx) {
+  struct device *dev = &queue->adapter->pdev->dev;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  u16 slot = tx_ring->next_to_use;
+  struct nic_tx_buffer *buf = &tx_ring->buffers[slot];
+  struct page *page;
+  dma_addr_t dma;
+
+  // the ring is shared with the stack, leave room for its next skb and
+  // let a stopped queue drain until nic_clean_tx_ring wakes it
+  if (netif_tx_queue_stopped(txq) ||
+      nic_uio_tx_free(tx_ring) <= NIC_TX_DESC_NEEDED) {
+    NIC_STATS_INC(queue, tx_ring_full);
+    return -ENOSPC;
+  }
+  if (xdp_tx) {
+    page = virt_to_page(xdpf->data);
+    dma = page_pool_get_dma_addr(page) + (xdpf->data - page_address(page));
+    dma_sync_single_for_device(dev, dma, xdpf->len, DMA_BIDIRECTIONAL);
+    buf->len = 0;
+  } else {
+    dma = dma_map_single(dev, xdpf->data, xdpf->len, DMA_TO_DEVICE);
+    if (dma_mapping_error(dev, dma)) {
+      return -ENOMEM;
+    }
+    buf->dma = dma;
+    buf->len = xdpf->len;
+    buf->page = false;
+  }
+  buf->xdpf = xdpf;
+  nic_tx_set_bd(queue, slot, dma, xdpf->len, true);
+  tx_ring->next_to_use = NIC_RING_WRAP(tx_ring, slot + 1);
+  NIC_STATS_INC(queue, tx_packets);
+  NIC_STATS_ADD(queue, tx_bytes, xdpf->len);
+  return 0;
+}
+
+// XDP_TX goes back out of the ring pair it came in on. frames copied out
+// of a umem are in a page of their own and get mapped
+static bool nic_xdp_tx_frame(struct nic_queue *queue,
+                             struct xdp_frame *xdpf) {
+  struct netdev_queue *txq =
+      netdev_get_tx_queue(queue->adapter->netdev, queue->id);
+  int err;
+
+  if (queue->adapter->uio_enabled) {
+    return false;
+  }
+  __netif_tx_lock(txq, smp_processor_id());
+  err = nic_xdp_post(queue, txq, xdpf, xdpf->mem.type == MEM_TYPE_PAGE_POOL);
+  __netif_tx_unlock(txq);
+  return !err;
+}
+
+// returns the skb for XDP_PASS, otherwise the page is consumed
+static struct sk_buff *nic_run_xdp(struct nic_queue *queue,
+                                   struct bpf_prog *prog, struct page *page,
+                                   u16 len, unsigned int *xdp_res) {
+  struct net_device *netdev = queue->adapter->netdev;
+  struct xdp_frame *xdpf;
+  struct sk_buff *skb;
+  struct xdp_buff xdp;
+  u32 metasize;
+  u32 act;
+
+  xdp_init_buff(&xdp, PAGE_SIZE, &queue->xdp_rxq);
+  xdp_prepare_buff(&xdp, page_address(page), NIC_RX_HEADROOM, len, true);
+  act = bpf_prog_run_xdp(prog, &xdp);
+  if (act != XDP_PASS) {
+    NIC_STATS_INC(queue, rx_packets);
+    NIC_STATS_ADD(queue, rx_bytes, len);
+  }
+
+  switch (act) {
+  case XDP_PASS:
+    skb = napi_build_skb(xdp.data_hard_start, PAGE_SIZE);
+    if (!skb) {
+      break;
+    }
+    skb_mark_for_recycle(skb);
+    skb_reserve(skb, xdp.data - xdp.data_hard_start);
+    __skb_put(skb, xdp.data_end - xdp.data);
+    metasize = xdp.data - xdp.data_meta;
+    if (metasize) {
+      skb_metadata_set(skb, metasize);
+    }
+    return skb;
+  case XDP_TX:
+    xdpf = xdp_convert_buff_to_frame(&xdp);
+    if (!xdpf || !nic_xdp_tx_frame(queue, xdpf)) {
+      trace_xdp_exception(netdev, prog, act);
+      break;
+    }
+    *xdp_res |= NIC_XDP_TX;
+    NIC_STATS_INC(queue, xdp_tx);
+    return NULL;
+  case XDP_REDIRECT:
+    if (xdp_do_redirect(netdev, &xdp, prog)) {
+      trace_xdp_exception(netdev, prog, act);
+      break;
+    }
+    *xdp_res |= NIC_XDP_REDIR;
+    NIC_STATS_INC(queue, xdp_redirect);
+    return NULL;
+  default:
+    bpf_warn_invalid_xdp_action(netdev, prog, act);
+    fallthrough;
+  case XDP_ABORTED:
+    trace_xdp_exception(netdev, prog, act);
+    fallthrough;
+  case XDP_DROP:
+    break;
+  }
+
+  NIC_STATS_INC(queue, xdp_drop);
+  page_pool_put_full_page(queue->rx_ring.page_pool, page, true);
+  return NULL;
+}
+
+// af_xdp
+
+// zero copy rx, the umem buffer goes to the program and from there
+// usually to the socket. XDP_PASS and XDP_TX copy the frame out
+static struct sk_buff *nic_receive_zc(struct nic_queue *queue,
+                                      struct bpf_prog *prog, u16 slot,
+                                      u16 len, unsigned int *xdp_res) {
+  struct net_device *netdev = queue->adapter->netdev;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  struct xdp_buff *xdp = rx_ring->xsk_bufs[slot];
+  struct xdp_frame *xdpf;
+  struct sk_buff *skb;
+  u32 act;
+
+  if (xdp) {
+    rx_ring->xsk_bufs[slot] = NULL;
+    nic_rx_set_coherent(rx_ring, slot);
+    xdp->data_end = xdp->data + len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+    xsk_buff_dma_sync_for_cpu(xdp);
+#else
+    xsk_buff_dma_sync_for_cpu(xdp, queue->xsk_pool);
+#endif
+  } else {
+    // posted while the fill ring was empty
+    xdp = xsk_buff_alloc(queue->xsk_pool);
+    if (!xdp) {
+      NIC_STATS_INC(queue, rx_dropped);
+      return NULL;
+    }
+    memcpy(xdp->data, rx_ring->data_vas[slot], len);
+    xdp->data_end = xdp->data + len;
+  }
+
+  act = prog ? bpf_prog_run_xdp(prog, xdp) : XDP_PASS;
+  if (act != XDP_PASS) {
+    NIC_STATS_INC(queue, rx_packets);
+    NIC_STATS_ADD(queue, rx_bytes, len);
+  }
+
+  switch (act) {
+  case XDP_PASS:
+    skb = napi_alloc_skb(&queue->napi, xdp->data_end - xdp->data);
+    if (!skb) {
+      break;
+    }
+    skb_put_data(skb, xdp->data, xdp->data_end - xdp->data);
+    xsk_buff_free(xdp);
+    return skb;
+  case XDP_REDIRECT:
+    if (xdp_do_redirect(netdev, xdp, prog)) {
+      trace_xdp_exception(netdev, prog, act);
+      break;
+    }
+    *xdp_res |= NIC_XDP_REDIR;
+    NIC_STATS_INC(queue, xdp_redirect);
+    return NULL;
+  case XDP_TX:
+    // the umem buffer is released by the copy
+    xdpf = xdp_convert_buff_to_frame(xdp);
+    if (!xdpf) {
+      trace_xdp_exception(netdev, prog, act);
+      break;
+    }
+    if (!nic_xdp_tx_frame(queue, xdpf)) {
+      trace_xdp_exception(netdev, prog, act);
+      xdp_return_frame(xdpf);
+      NIC_STATS_INC(queue, xdp_drop);
+      return NULL;
+    }
+    *xdp_res |= NIC_XDP_TX;
+    NIC_STATS_INC(queue, xdp_tx);
+    return NULL;
+  default:
+    bpf_warn_invalid_xdp_action(netdev, prog, act);
+    fallthrough;
+  case XDP_ABORTED:
+    trace_xdp_exception(netdev, prog, act);
+    fallthrough;
+  case XDP_DROP:
+    break;
+  }
+
+  NIC_STATS_INC(queue, xdp_drop);
+  xsk_buff_free(xdp);
+  return NULL;
+}
+
+// post descriptors of the socket tx ring straight from the umem,
+// returns false when the budget ran out
+static bool nic_xsk_xmit(struct nic_queue *queue, int budget) {
+  struct xsk_buff_pool *pool = queue->xsk_pool;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct netdev_queue *txq =
+      netdev_get_tx_queue(queue->adapter->netdev, queue->id);
+  struct xdp_desc desc;
+  dma_addr_t dma;
+  int sent = 0;
+  u16 slot;
+
+  __netif_tx_lock(txq, smp_processor_id());
+  // the ring is shared with the stack, see nic_xdp_post
+  while (sent < budget && !netif_tx_queue_stopped(txq) &&
+         nic_uio_tx_free(tx_ring) > NIC_TX_DESC_NEEDED &&
+         xsk_tx_peek_desc(pool, &desc)) {
+    slot = tx_ring->next_to_use;
+    dma = xsk_buff_raw_get_dma(pool, desc.addr);
+    xsk_buff_raw_dma_sync_for_device(pool, dma, desc.len);
+    tx_ring->buffers[slot].len = 0;
+    tx_ring->buffers[slot].xsk = true;
+    nic_tx_set_bd(queue, slot, dma, desc.len, true);
+    tx_ring->next_to_use = NIC_RING_WRAP(tx_ring, slot + 1);
+    NIC_STATS_INC(queue, tx_packets);
+    NIC_STATS_ADD(queue, tx_bytes, desc.len);
+    sent++;
+  }
+  if (sent) {
+    xsk_tx_release(pool);
+    nic_update_tx_tail(queue);
+  }
+  __netif_tx_unlock(txq);
+
+  // descriptors in flight complete into nic_poll, which comes back here,
+  // the socket only has to kick an idle queue
+  if (xsk_uses_need_wakeup(pool)) {
+    if (sent >= budget || tx_ring->next_to_clean != tx_ring->next_to_use) {
+      xsk_clear_tx_need_wakeup(pool);
+    } else {
+      xsk_set_tx_need_wakeup(pool);
+    }
+  }
+  return sent < budget;
+}
+
+static int nic_xsk_wakeup(struct net_device *netdev, u32 qid, u32 flags) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  struct nic_queue *queue;
+
+  if (!netif_running(netdev) || !netif_carrier_ok(netdev)) {
+    return -ENETDOWN;
+  }
+  if (qid >= adapter->num_queues || !adapter->queues[qid].xsk_pool) {
+    return -EINVAL;
+  }
+  queue = &adapter->queues[qid];
+  // a running poll picks the new descriptors up before it completes
+  if (!napi_if_scheduled_mark_missed(&queue->napi)) {
+    napi_schedule(&queue->napi);
+  }
+  return 0;
+}
+
+// bind or unbind a umem, the queue is torn down and set up again around it
+static int nic_xsk_pool_setup(struct net_device *netdev,
+                              struct xsk_buff_pool *pool, u16 qid) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  bool running = netif_running(netdev);
+  struct xsk_buff_pool *old;
+  struct nic_queue *queue;
+  int err;
+
+  if (qid >= adapter->num_queues) {
+    return -EINVAL;
+  }
+  queue = &adapter->queues[qid];
+  old = queue->xsk_pool;
+  if (pool) {
+    if (old) {
+      return -EBUSY;
+    }
+    // a umem frame takes a whole rx buffer
+    if (netdev->mtu > NIC_XDP_MAX_MTU ||
+        xsk_pool_get_rx_frame_size(pool) < NIC_RX_PKT_SIZE) {
+      netdev_err(netdev, "xsk frames too small for queue %u\n", qid);
+      return -EINVAL;
+    }
+    err = xsk_pool_dma_map(pool, &adapter->pdev->dev, 0);
+    if (err) {
+      return err;
+    }
+  } else if (!old) {
+    return -EINVAL;
+  }
+
+  err = nic_raw_port_quiesce(adapter, qid == NIC_UIO_QUEUE);
+  if (err) {
+    goto err_unmap;
+  }
+
+  if (running) {
+    nic_close(netdev);
+  }
+  // completions of the old pool are returned before it goes
+  nic_free_queue(queue);
+  queue->xsk_pool = pool;
+  err = nic_alloc_queue(queue);
+  if (err) {
+    netdev_err(netdev, "queue %u setup failed, keep the old pool\n", qid);
+    queue->xsk_pool = old;
+    if (nic_alloc_queue(queue)) {
+      netdev_err(netdev, "restore queue %u failed\n", qid);
+      netif_device_detach(netdev);
+      // see nic_resize_rings
+      if (running) {
+        dev_close(netdev);
+      }
+      running = false;
+    }
+  }
+  if (running) {
+    nic_open(netdev);
+  }
+  up(&adapter->raw_sema);
+
+  if (err) {
+    goto err_unmap;
+  }
+  if (old) {
+    xsk_pool_dma_unmap(old, 0);
+  }
+  netdev_info(netdev, "queue %u af_xdp zero copy %s\n", qid,
+              pool ? "on" : "off");
+  return 0;
+
+err_unmap:
+  if (pool) {
+    xsk_pool_dma_unmap(pool, 0);
+  }
+  return err;
+}
+
+// once per poll, one tx doorbell for the XDP_TX batch
+static void nic_xdp_finalize(struct nic_queue *queue, unsigned int xdp_res) {
+  struct netdev_queue *txq;
+
+  if (xdp_res & NIC_XDP_REDIR) {
+    xdp_do_flush();
+  }
+  if (xdp_res & NIC_XDP_TX) {
+    txq = netdev_get_tx_queue(queue->adapter->netdev, queue->id);
+    __netif_tx_lock(txq, smp_processor_id());
+    nic_update_tx_tail(queue);
+    __netif_tx_unlock(txq);
+  }
+}
+
+// redirect target, e.g. the sibling port. frames of one call share a
+// doorbell, rung when the redirect batch is flushed
+static int nic_xdp_xmit(struct net_device *netdev, int n,
+                        struct xdp_frame **frames, u32 flags) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  struct netdev_queue *txq;
+  struct nic_queue *queue;
+  int nxmit = 0;
+
+  if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK)) {
+    return -EINVAL;
+  }
+  if (!netif_running(netdev) || !netif_carrier_ok(netdev) ||
+      adapter->uio_enabled) {
+    return -ENETDOWN;
+  }
+
+  queue = &adapter->queues[smp_processor_id() % adapter->num_queues];
+  txq = netdev_get_tx_queue(netdev, queue->id);
+  __netif_tx_lock(txq, smp_processor_id());
+  while (nxmit < n && !nic_xdp_post(queue, txq, frames[nxmit], false)) {
+    nxmit++;
+  }
+  if (flags & XDP_XMIT_FLUSH) {
+    nic_update_tx_tail(queue);
+  }
+  __netif_tx_unlock(txq);
+  return nxmit;
+}
+
+static int nic_xdp_setup(struct net_device *netdev, struct bpf_prog *prog,
+                         struct netlink_ext_ack *extack) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  struct bpf_prog *old;
+
+  if (prog && netdev->mtu > NIC_XDP_MAX_MTU) {
+    NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP");
+    return -EOPNOTSUPP;
+  }
+  // nic_poll picks the program up at its next run
+  old = xchg(&adapter->xdp_prog, prog);
+  if (old) {
+    bpf_prog_put(old);
+  }
+  netdev_info(netdev, "xdp program %s\n", prog ? "attached" : "detached");
+  return 0;
+}
+
+static int nic_bpf(struct net_device *netdev, struct netdev_bpf *bpf) {
+  switch (bpf->command) {
+  case XDP_SETUP_PROG:
+    return nic_xdp_setup(netdev, bpf->prog, bpf->extack);
+  case XDP_SETUP_XSK_POOL:
+    return nic_xsk_pool_setup(netdev, bpf->xsk.pool, bpf->xsk.queue_id);
+  default:
+    return -EINVAL;
+  }
+}
+#endif
+
+// chain a continuation buffer onto skb as a page frag
+static bool nic_rx_add_frag(struct nic_queue *queue, struct sk_buff *skb,
+                            u16 slot, u16 len) {
+  struct page *page;
+
+  if (skb_shinfo(skb)->nr_frags >= MAX_SKB_FRAGS) {
+    return false;
+  }
+  page = nic_rx_take_page(queue, slot, len);
+  if (!page) {
+    return false;
+  }
+  skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, page, NIC_RX_HEADROOM, len,
+                  PAGE_SIZE);
+  skb_mark_for_recycle(skb);
+  // the sum of the first buffer does not cover the frame
+  skb->ip_summed = CHECKSUM_NONE;
+  return true;
+}
+
+// consumes one descriptor, returns the skb once its last buffer is in.
+// with hw_eop a buffer the device filled up without eop is continued by
+// the next one
+static struct sk_buff *nic_receive_skb(struct nic_queue *queue,
+                                       struct bpf_prog *prog,
+                                       unsigned int *xdp_res) {
+  struct net_device *netdev = queue->adapter->netdev;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  u16 slot = rx_ring->next_to_use;
+  struct page *page = rx_ring->pages[slot];
   struct sk_buff *skb = NULL;
   struct nic_rx_frame *frame;
   struct nic_bd *bd;
+  bool eop;
   u16 len;
-  netdev_info(netdev, "nic_receive_skb\n");
 
-  frame = adapter->rx_ring.data_vas[adapter->rx_ring.next_to_use];
-  bd = &adapter->rx_ring.bd_va[adapter->rx_ring.next_to_use];
+  frame = rx_ring->data_vas[slot];
+  bd = &rx_ring->bd_va[slot];
   len = le16_to_cpu(bd->len);
-  if (len == 0) {
-    netdev_info(netdev, "nic_receive_skb: data_len == 0\n");
+  eop = !hw_eop || (bd->flags & NIC_BD_FLAG_EOP) || len < NIC_RX_PKT_SIZE;
+  trace_nic_rx_desc(queue, slot, len);
+
+  // rest of a frame already dropped
+  if (queue->rx_discard) {
+    queue->rx_discard = !eop;
     goto err_recv;
   }
 
-  skb = napi_alloc_skb(&adapter->napi, len);
-  if (!skb) {
-    netdev_err(netdev, "napi_alloc_skb failed\n");
+  if (len == 0 || len > NIC_RX_PKT_SIZE) {
+    netdev_dbg(netdev, "nic_receive_skb: bad data_len %u\n", len);
+    goto err_drop;
+  }
+
+#ifndef NO_PCI
+  if (queue->xsk_pool) {
+    // umem buffers hold one frame, nic_xsk_pool_setup checks the mtu
+    if (!eop) {
+      goto err_drop;
+    }
+    skb = nic_receive_zc(queue, prog, slot, len, xdp_res);
     goto err_recv;
   }
-  skb_put_data(skb, frame->data, len);
-  netdev_info(netdev, "nic_receive_skb->len: %u\n", skb->len);
+  if (prog && !queue->rx_skb) {
+    // nic_xdp_setup keeps the mtu within one buffer
+    if (!eop) {
+      goto err_drop;
+    }
+    page = nic_rx_take_page(queue, slot, len);
+    if (!page) {
+      goto err_drop;
+    }
+    skb = nic_run_xdp(queue, prog, page, len, xdp_res);
+    goto err_recv;
+  }
+#endif
+
+  if (queue->rx_skb) {
+    skb = queue->rx_skb;
+    queue->rx_skb = NULL;
+    if (!nic_rx_add_frag(queue, skb, slot, len)) {
+      napi_consume_skb(skb, 1);
+      skb = NULL;
+      goto err_drop;
+    }
+  } else if (page) {
+    nic_rx_sync_for_cpu(queue, slot, len);
+    // the skb takes the page, it returns to the pool when freed
+    skb = napi_build_skb(page_address(page), PAGE_SIZE);
+    if (!skb) {
+      goto err_drop;
+    }
+    skb_mark_for_recycle(skb);
+    skb_reserve(skb, NIC_RX_HEADROOM);
+    __skb_put(skb, len);
+    nic_rx_set_coherent(rx_ring, slot);
+  } else {
+    skb = napi_alloc_skb(&queue->napi, len);
+    if (!skb) {
+      goto err_drop;
+    }
+    if (len > ETH_HLEN && (netdev->features & NETIF_F_RXCSUM)) {
+      // one pass copies the frame and sums what follows the mac header
+      skb_put_data(skb, frame->data, ETH_HLEN);
+      skb->csum = csum_partial_copy_nocheck(
+          frame->data + ETH_HLEN, skb_put(skb, len - ETH_HLEN), len - ETH_HLEN);
+      skb->ip_summed = CHECKSUM_COMPLETE;
+    } else {
+      skb_put_data(skb, frame->data, len);
+    }
+  }
+  if (!eop) {
+    queue->rx_skb = skb;
+    skb = NULL;
+  }
+  goto err_recv;
+
+err_drop:
+  NIC_STATS_INC(queue, rx_dropped);
+  queue->rx_discard = !eop;
 
 err_recv:
 
   bd->flags &= ~NIC_BD_FLAG_VALID;
-  adapter->rx_ring.next_to_use =
-      (adapter->rx_ring.next_to_use + 1) % adapter->rx_ring.bd_size;
+  rx_ring->next_to_use = NIC_RING_WRAP(rx_ring, rx_ring->next_to_use + 1);
+  rx_ring->next_to_clean = rx_ring->next_to_use;
 
   // bd->flags |= NIC_BD_FLAG_USED;
   return skb;
 }
 
+// sum the per cpu counters of a queue into data, in struct order
+void nic_queue_stats_read(struct nic_queue *queue, u64 *data) {
+  u64 vals[NIC_QUEUE_STATS_LEN];
+  unsigned int start;
+  int cpu, i;
+
+  memset(data, 0, sizeof(vals));
+  if (!queue->stats) {
+    return;
+  }
+  for_each_possible_cpu(cpu) {
+    const struct nic_queue_stats *stats = per_cpu_ptr(queue->stats, cpu);
+    const u64_stats_t *fields = (const u64_stats_t *)stats;
+
+    do {
+      start = u64_stats_fetch_begin(&stats->syncp);
+      for (i = 0; i < NIC_QUEUE_STATS_LEN; i++) {
+        vals[i] = u64_stats_read(&fields[i]);
+      }
+    } while (u64_stats_fetch_retry(&stats->syncp, start));
+
+    for (i = 0; i < NIC_QUEUE_STATS_LEN; i++) {
+      data[i] += vals[i];
+    }
+  }
+}
+
+static void nic_get_stats64(struct net_device *netdev,
+                            struct rtnl_link_stats64 *stats) {
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  u64 data[NIC_QUEUE_STATS_LEN];
+  int q;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    nic_queue_stats_read(&adapter->queues[q], data);
+    stats->tx_packets += data[NIC_QUEUE_STAT_IDX(tx_packets)];
+    stats->tx_bytes += data[NIC_QUEUE_STAT_IDX(tx_bytes)];
+    stats->tx_dropped += data[NIC_QUEUE_STAT_IDX(tx_dropped)];
+    stats->rx_packets += data[NIC_QUEUE_STAT_IDX(rx_packets)];
+    stats->rx_bytes += data[NIC_QUEUE_STAT_IDX(rx_bytes)];
+    stats->rx_dropped += data[NIC_QUEUE_STAT_IDX(rx_dropped)];
+  }
+}
+
 static void nic_set_rx_mode(struct net_device *netdev) {
   // netdev_info(netdev, "nic_set_rx_mode\n");
 }
@@ -1060,8 +2515,27 @@ static void nic_tx_timeout(struct net_device *dev, unsigned int txqueue) {
   // netdev_info(dev, "nic_tx_timeout\n");
 }
 
+// rx buffers stay NIC_RX_PKT_SIZE and the device has no mtu register,
+// max_mtu keeps frames within one buffer unless hw_eop lets
+// nic_receive_skb chain them
 static int nic_change_mtu(struct net_device *netdev, int new_mtu) {
-  // netdev_info(netdev, "nic_change_mtu\n");
+  struct nic_adapter *adapter = netdev_priv(netdev);
+  int q;
+
+  if (READ_ONCE(adapter->xdp_prog) && new_mtu > NIC_XDP_MAX_MTU) {
+    netdev_err(netdev, "mtu above %d with an xdp program\n",
+               NIC_XDP_MAX_MTU);
+    return -EINVAL;
+  }
+  for (q = 0; q < adapter->num_queues; q++) {
+    if (adapter->queues[q].xsk_pool && new_mtu > NIC_XDP_MAX_MTU) {
+      netdev_err(netdev, "mtu above %d with an xsk pool\n",
+                 NIC_XDP_MAX_MTU);
+      return -EINVAL;
+    }
+  }
+  netdev_info(netdev, "mtu %u -> %d\n", netdev->mtu, new_mtu);
+  WRITE_ONCE(netdev->mtu, new_mtu);
   return 0;
 }
 
@@ -1084,17 +2558,236 @@ static void nic_netpoll(struct net_device *netdev) {
   // netdev_info(netdev, "nic_netpoll\n");
 }
 
+// tx doorbell
+
+// the batch did not fill up within tx-usecs, ring the doorbell for it
+static enum hrtimer_restart nic_tx_flush_func(struct hrtimer *timer) {
+  struct nic_queue *queue =
+      container_of(timer, struct nic_queue, tx_flush_timer);
+  struct netdev_queue *txq =
+      netdev_get_tx_queue(queue->adapter->netdev, queue->id);
+
+  __netif_tx_lock(txq, smp_processor_id());
+  if (queue->tx_ring.next_to_use != queue->tx_ring.last_sync) {
+    nic_update_tx_tail(queue);
+  }
+  __netif_tx_unlock(txq);
+  return HRTIMER_NORESTART;
+}
+
+// rx moderation
+
+// rx-frames pending when the timer fires go to napi without touching the
+// mask register, otherwise the vector is unmasked for the next frame
+static enum hrtimer_restart nic_rx_mod_func(struct hrtimer *timer) {
+  struct nic_queue *queue = container_of(timer, struct nic_queue, rx_mod_timer);
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  u16 owned = NIC_RING_WRAP(rx_ring, rx_ring->last_sync - rx_ring->next_to_use);
+  u16 frames = clamp_t(u32, READ_ONCE(queue->adapter->rx_max_frames), 1,
+                       max_t(u16, owned, 1));
+  u16 slot = NIC_RING_WRAP(rx_ring, rx_ring->next_to_use + frames - 1);
+
+  if (rx_ring->bd_va[slot].flags & NIC_BD_FLAG_VALID) {
+    napi_schedule(&queue->napi);
+  } else {
+    nic_set_int(queue, NIC_VEC_RX, true);
+  }
+  return HRTIMER_NORESTART;
+}
+
+static void nic_rx_dim_work(struct work_struct *work) {
+  struct dim *dim = container_of(work, struct dim, work);
+  struct nic_queue *queue = container_of(dim, struct nic_queue, rx_dim);
+  struct dim_cq_moder moder =
+      net_dim_get_rx_moderation(dim->mode, dim->profile_ix);
+
+  WRITE_ONCE(queue->rx_usecs, moder.usec);
+  dim->state = DIM_START_MEASURE;
+}
+
+void nic_set_rx_usecs(struct nic_adapter *adapter, u32 usecs) {
+  int q;
+
+  for (q = 0; q < adapter->num_queues; q++) {
+    WRITE_ONCE(adapter->queues[q].rx_usecs, usecs);
+  }
+}
+
+// called when napi completes, instead of unmasking rx right away
+static void nic_rx_moderate(struct nic_queue *queue) {
+  struct dim_sample sample;
+  u32 usecs;
+
+  if (READ_ONCE(queue->adapter->rx_adaptive)) {
+    queue->rx_dim_events++;
+    dim_update_sample(queue->rx_dim_events, queue->rx_dim_packets,
+                      queue->rx_dim_bytes, &sample);
+    net_dim(&queue->rx_dim, sample);
+  }
+
+  usecs = READ_ONCE(queue->rx_usecs);
+  if (!usecs) {
+    nic_set_int(queue, NIC_VEC_RX, true);
+    return;
+  }
+  hrtimer_start(&queue->rx_mod_timer, us_to_ktime(usecs), HRTIMER_MODE_REL);
+}
+
+// software rss
+
+// the hash function of the microsoft rss spec
+static u32 nic_toeplitz(const u8 *key, const u8 *data, int len) {
+  u32 v = get_unaligned_be32(key);
+  u32 hash = 0;
+  int i;
+  int b;
+
+  for (i = 0; i < len; i++) {
+    for (b = 7; b >= 0; b--) {
+      if (data[i] & BIT(b)) {
+        hash ^= v;
+      }
+      v <<= 1;
+      if (key[i + 4] & BIT(b)) {
+        v |= 1;
+      }
+    }
+  }
+  return hash;
+}
+
+// addresses, then ports for tcp and udp, in network order
+static u32 nic_rss_hash(struct nic_adapter *adapter, struct sk_buff *skb,
+                        enum pkt_hash_types *type) {
+  struct flow_keys keys;
+  u8 data[36];
+  int len;
+
+  *type = PKT_HASH_TYPE_NONE;
+  if (!skb_flow_dissect_flow_keys(skb, &keys, 0)) {
+    return 0;
+  }
+  switch (keys.control.addr_type) {
+  case FLOW_DISSECTOR_KEY_IPV4_ADDRS:
+    memcpy(data, &keys.addrs.v4addrs, sizeof(keys.addrs.v4addrs));
+    len = sizeof(keys.addrs.v4addrs);
+    break;
+  case FLOW_DISSECTOR_KEY_IPV6_ADDRS:
+    memcpy(data, &keys.addrs.v6addrs, sizeof(keys.addrs.v6addrs));
+    len = sizeof(keys.addrs.v6addrs);
+    break;
+  default:
+    return 0;
+  }
+  *type = PKT_HASH_TYPE_L3;
+  if ((keys.basic.ip_proto == IPPROTO_TCP ||
+       keys.basic.ip_proto == IPPROTO_UDP) &&
+      !(keys.control.flags & FLOW_DIS_IS_FRAGMENT)) {
+    memcpy(data + len, &keys.ports.ports, sizeof(keys.ports.ports));
+    len += sizeof(keys.ports.ports);
+    *type = PKT_HASH_TYPE_L4;
+  }
+  return nic_toeplitz(adapter->rss_key, data, len);
+}
+
+static void nic_rss_ipi(void *info) {
+  struct nic_rss_ctx *ctx = info;
+
+  napi_schedule(&ctx->napi);
+}
+
+// queue skb on the cpu of its flow. every frame goes through a backlog,
+// also a local one, so a flow stays in order when the irq moves
+static void nic_rss_steer(struct nic_queue *queue, struct sk_buff *skb) {
+  struct nic_adapter *adapter = queue->adapter;
+  enum pkt_hash_types type;
+  struct nic_rss_ctx *ctx;
+  bool kick;
+  u32 hash;
+  u32 cpu;
+
+  hash = nic_rss_hash(adapter, skb, &type);
+  if (type != PKT_HASH_TYPE_NONE) {
+    skb_set_hash(skb, hash, type);
+  }
+  cpu = READ_ONCE(adapter->rss_indir[hash % NIC_RSS_INDIR_SIZE]);
+  if (cpu >= nr_cpu_ids || !cpu_online(cpu)) {
+    cpu = smp_processor_id();
+  }
+  ctx = per_cpu_ptr(adapter->rss, cpu);
+
+  spin_lock(&ctx->backlog.lock);
+  if (skb_queue_len(&ctx->backlog) >= NIC_RSS_BACKLOG) {
+    spin_unlock(&ctx->backlog.lock);
+    NIC_STATS_INC(queue, rx_dropped);
+    napi_consume_skb(skb, 1);
+    return;
+  }
+  // only the first frame after the context drained has to wake it
+  kick = skb_queue_empty(&ctx->backlog);
+  __skb_queue_tail(&ctx->backlog, skb);
+  spin_unlock(&ctx->backlog.lock);
+
+  if (!kick) {
+    return;
+  }
+  if (cpu == smp_processor_id()) {
+    napi_schedule(&ctx->napi);
+  } else {
+    // busy means an ipi for this context is still on its way
+    smp_call_function_single_async(cpu, &ctx->csd);
+  }
+}
+
+static int nic_rss_poll(struct napi_struct *napi, int budget) {
+  struct nic_rss_ctx *ctx = container_of(napi, struct nic_rss_ctx, napi);
+  struct sk_buff_head frames;
+  struct sk_buff *skb;
+  int work_done = 0;
+
+  __skb_queue_head_init(&frames);
+  spin_lock(&ctx->backlog.lock);
+  while (work_done < budget && (skb = __skb_dequeue(&ctx->backlog))) {
+    __skb_queue_tail(&frames, skb);
+    work_done++;
+  }
+  spin_unlock(&ctx->backlog.lock);
+
+  while ((skb = __skb_dequeue(&frames))) {
+    napi_gro_receive(napi, skb);
+  }
+
+  // a frame queued meanwhile marked napi missed, it polls again
+  if (work_done < budget) {
+    napi_complete_done(napi, work_done);
+  }
+  return work_done;
+}
+
 static int nic_poll(struct napi_struct *napi, int budget) {
-  struct nic_adapter *adapter = container_of(napi, struct nic_adapter, napi);
+  struct nic_queue *queue = container_of(napi, struct nic_queue, napi);
+  struct nic_adapter *adapter = queue->adapter;
   struct nic_rx_ring *rx_ring;
+  struct bpf_prog *prog = READ_ONCE(adapter->xdp_prog);
+  unsigned int xdp_res = 0;
   struct sk_buff *skb;
   int work_done = 0;
+  bool tx_clean_complete = true;
+  // rx of the raw cdev queue is drained by nic_uio_poll_work
+  bool uio_rx = adapter->uio_enabled && queue->id == NIC_UIO_QUEUE;
   // netdev_info(adapter->netdev, "nic_poll\n");
 
   // TODO
   // int work_to_do = min(*budget, netdev->quota);
 
-  rx_ring = &adapter->rx_ring;
+#ifndef NO_PCI
+  tx_clean_complete = nic_clean_tx_ring(queue, budget);
+  if (queue->xsk_pool && !nic_xsk_xmit(queue, budget)) {
+    tx_clean_complete = false;
+  }
+#endif
+
+  rx_ring = &queue->rx_ring;
 
   // netdev_info(adapter->netdev,
   //             "rx_ring->bd_va[rx_ring->next_to_use].flags = %llx,
@@ -1102,33 +2795,57 @@ static int nic_poll(struct napi_struct *napi, int budget) {
   //             rx_ring->bd_va[rx_ring->next_to_use].flags,
   //             rx_ring->next_to_use);
 
-  while (rx_ring->bd_va[rx_ring->next_to_use].flags & NIC_BD_FLAG_VALID) {
-    netdev_info(adapter->netdev, "nic_poll: next_to_use = %u\n",
-                rx_ring->next_to_use);
+  while (!uio_rx &&
+         rx_ring->bd_va[rx_ring->next_to_use].flags & NIC_BD_FLAG_VALID) {
     if (work_done >= budget) {
       break;
     }
     work_done++;
 
-    skb = nic_receive_skb(adapter);
-    if (!skb) {
-      break;
+    // NULL while a frame spans more buffers or was dropped
+    skb = nic_receive_skb(queue, prog, &xdp_res);
+    if (skb) {
+      queue->rx_dim_packets++;
+      queue->rx_dim_bytes += skb->len;
+      NIC_STATS_INC(queue, rx_packets);
+      NIC_STATS_ADD(queue, rx_bytes, skb->len);
+      skb_record_rx_queue(skb, queue->id);
+      skb->protocol = eth_type_trans(skb, adapter->netdev);
+      if (adapter->netdev->features & NETIF_F_RXHASH) {
+        nic_rss_steer(queue, skb);
+      } else {
+        napi_gro_receive(napi, skb);
+      }
     }
-    skb->protocol = eth_type_trans(skb, adapter->netdev);
-    napi_gro_receive(napi, skb);
 
-    if ((rx_ring->last_sync + rx_ring->bd_size - rx_ring->next_to_use) %
-            rx_ring->bd_size <=
-        NIC_RX_SYNC_THRESHOLD) {
-      rx_ring->last_sync =
-          (rx_ring->last_sync + NIC_RX_SYNC_NUM) % rx_ring->bd_size;
-      nic_update_rx_tail(adapter);
+    if (NIC_RING_WRAP(rx_ring, rx_ring->last_sync - rx_ring->next_to_use) <=
+        READ_ONCE(adapter->rx_sync_num) / 2) {
+      nic_rx_post_sync(queue, true);
+      nic_update_rx_tail(queue);
     }
   }
+#ifndef NO_PCI
+  if (xdp_res) {
+    nic_xdp_finalize(queue, xdp_res);
+  }
+#endif
+
+  trace_nic_poll(queue, budget, work_done, tx_clean_complete);
+  // tx reclaim used the whole budget, poll again
+  if (!tx_clean_complete) {
+    NIC_STATS_INC(queue, poll_exhausted);
+    return budget;
+  }
+  if (work_done >= budget) {
+    NIC_STATS_INC(queue, poll_exhausted);
+  }
 
 #ifndef NO_PCI
   if (napi_complete_done(napi, work_done)) {
-    nic_set_int(adapter, NIC_VEC_RX, true);
+    nic_set_int(queue, NIC_VEC_TX, true);
+    if (!uio_rx) {
+      nic_rx_moderate(queue);
+    }
   }
 #endif
 
@@ -1162,158 +2879,558 @@ static int nic_set_features(struct net_device *netdev,
 #ifndef NO_PCI
 
 static irqreturn_t nic_interrupt_tx(int irq, void *data) {
-  struct net_device *netdev = data;
-  struct nic_adapter *adapter = netdev_priv(netdev);
-  struct clean_work_ctx *work_ctx;
-  // netdev_info(netdev, "nic_interrupt_tx\n");
-  work_ctx = kmalloc(sizeof(struct clean_work_ctx), GFP_ATOMIC);
-  if (!work_ctx) {
-    netdev_err(netdev, "work_ctx kmalloc failed\n");
-    return IRQ_HANDLED;
-  }
-  work_ctx->adapter = adapter;
+  struct nic_queue *queue = data;
+  // netdev_info(queue->adapter->netdev, "nic_interrupt_tx\n");
+
+  NIC_STATS_INC(queue, tx_irqs);
+  // reclaimed by nic_poll, re-enabled when napi completes
+  nic_set_int(queue, NIC_VEC_TX, false);
+  napi_schedule(&queue->napi);
 
-  // netdev_info(netdev, "INIT_WORK nic_clean_tx_ring_work\n");
-  INIT_WORK(&work_ctx->work, nic_clean_tx_ring_work);
-  if (!queue_work(nic_clean_wq, &work_ctx->work)) {
-    netdev_err(netdev, "schedule_work failed\n");
-    kfree(work_ctx);
-  }
   return IRQ_HANDLED;
 }
 
 static irqreturn_t nic_interrupt_rx(int irq, void *data) {
-  struct net_device *netdev = data;
-  struct nic_adapter *adapter = netdev_priv(netdev);
-  // netdev_info(netdev, "nic_interrupt_rx\n");
-
-  if (adapter->uio_enabled) {
-    struct uio_poll_work_ctx *work_ctx;
-    work_ctx = kmalloc(sizeof(struct uio_poll_work_ctx), GFP_ATOMIC);
-    if (!work_ctx) {
-      netdev_err(netdev, "work_ctx kmalloc failed\n");
-      return IRQ_HANDLED;
-    }
-    work_ctx->adapter = adapter;
-
-    // netdev_info(netdev, "INIT_WORK nic_uio_poll_work\n");
-    INIT_WORK(&work_ctx->work, nic_uio_poll_work);
-    if (!queue_work(nic_uio_poll_wq, &work_ctx->work)) {
-      netdev_err(netdev, "schedule_work failed\n");
-      kfree(work_ctx);
-    }
+  struct nic_queue *queue = data;
+  struct nic_adapter *adapter = queue->adapter;
+  // netdev_info(adapter->netdev, "nic_interrupt_rx\n");
+
+  NIC_STATS_INC(queue, rx_irqs);
+  if (adapter->uio_enabled && queue->id == NIC_UIO_QUEUE) {
+    // already pending work picks up the new frames too
+    queue_work(nic_uio_poll_wq, &queue->uio_poll_work);
   } else {
-    if (napi_schedule_prep(&adapter->napi)) {
-      __napi_schedule(&adapter->napi);
+    if (napi_schedule_prep(&queue->napi)) {
+      __napi_schedule(&queue->napi);
     }
   }
 
-  nic_set_int(adapter, NIC_VEC_RX, false);
+  nic_set_int(queue, NIC_VEC_RX, false);
 
   return IRQ_HANDLED;
 }
 
-static void nic_clean_tx_ring_work(struct work_struct *work) {
-  struct clean_work_ctx *work_ctx =
-      container_of(work, struct clean_work_ctx, work);
-  struct nic_adapter *adapter = work_ctx->adapter;
+// called from nic_poll, returns false when the budget ran out
+static bool nic_clean_tx_ring(struct nic_queue *queue, int budget) {
+  struct nic_adapter *adapter = queue->adapter;
   struct nic_bd *bd_clean;
-  void *data_clean;
-  struct nic_tx_ring *tx_ring = &adapter->tx_ring;
-  // netdev_info(adapter->netdev, "nic_clean_tx_ring_work\n");
-  nic_set_int(adapter, NIC_VEC_TX, false);
-  while (1) {
-    if (!tx_ring->bd_va || !tx_ring->skbs) {
+  struct nic_tx_buffer *buf;
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct netdev_queue *txq = netdev_get_tx_queue(adapter->netdev, queue->id);
+  unsigned int pkts = 0;
+  unsigned int bytes = 0;
+  u32 xsk_frames = 0;
+  int cleaned = 0;
+  // netdev_info(adapter->netdev, "nic_clean_tx_ring\n");
+  while (cleaned < budget) {
+    if (!tx_ring->bd_va || !tx_ring->buffers) {
       break;
     }
     bd_clean = &tx_ring->bd_va[tx_ring->next_to_clean];
-    data_clean = tx_ring->data_vas[tx_ring->next_to_clean];
+    buf = &tx_ring->buffers[tx_ring->next_to_clean];
     if (!(bd_clean->flags & NIC_BD_FLAG_VALID)) {
       break;
     }
-
-    if (adapter->uio_enabled) {
-      dma_free_coherent(&adapter->pdev->dev, bd_clean->len, data_clean,
-                        bd_clean->addr);
-      netdev_info(adapter->netdev, "free uio data %u\n",
-                  tx_ring->next_to_clean);
-    } else {
-      dma_unmap_single(&adapter->pdev->dev, bd_clean->addr, bd_clean->len,
-                       DMA_TO_DEVICE);
-      dev_kfree_skb_any(data_clean);
-      netdev_info(adapter->netdev, "free skb %u\n", tx_ring->next_to_clean);
+    trace_nic_tx_clean(queue, tx_ring->next_to_clean,
+                       le16_to_cpu(bd_clean->len));
+
+    // uio frames live in the preallocated buffer, nothing to free
+    nic_tx_unmap(queue, buf);
+    if (buf->skb) {
+      pkts++;
+      bytes += buf->skb->len;
+      napi_consume_skb(buf->skb, budget);
+      buf->skb = NULL;
+    }
+    if (buf->xdpf) {
+      xdp_return_frame(buf->xdpf);
+      buf->xdpf = NULL;
+    }
+    if (buf->xsk) {
+      xsk_frames++;
+      buf->xsk = false;
     }
 
     bd_clean->flags &= ~NIC_BD_FLAG_VALID;
     // bd_clean->flags &= ~NIC_BD_FLAG_USED;
 
-    tx_ring->next_to_clean = (tx_ring->next_to_clean + 1) % tx_ring->bd_size;
+    tx_ring->next_to_clean = NIC_RING_WRAP(tx_ring, tx_ring->next_to_clean + 1);
+    cleaned++;
+  }
+
+  if (xsk_frames) {
+    xsk_tx_completed(queue->xsk_pool, xsk_frames);
+  }
+  if (pkts) {
+    netdev_tx_completed_queue(txq, pkts, bytes);
+    // pairs with the barrier in nic_xmit_frame
+    smp_mb();
+    if (netif_tx_queue_stopped(txq) && netif_carrier_ok(adapter->netdev) &&
+        nic_uio_tx_free(tx_ring) >= NIC_TX_WAKE_THRESHOLD) {
+      netif_tx_wake_queue(txq);
+    }
+  }
+  if (queue->id == NIC_UIO_QUEUE) {
+    // publish completions to the mapped ctl
+    smp_store_release(&tx_ring->uio_ctl->next_to_clean,
+                      tx_ring->next_to_clean);
+    if (wq_has_sleeper(&adapter->uio_tx_wait)) {
+      wake_up(&adapter->uio_tx_wait);
+    }
+    if (!list_empty(&adapter->uio_uring_tx)) {
+      nic_cdev_uring_kick(adapter, &adapter->uio_uring_tx);
+    }
+  }
+
+  return cleaned < budget;
+}
+
+static bool nic_uio_rxq_push(struct nic_uio_rxq *rxq, u16 slot,
+                             frame_len_t len) {
+  u32 head = rxq->head;
+
+  if (head - smp_load_acquire(&rxq->tail) >= NIC_UIO_RXQ_SIZE) {
+    return false;
+  }
+  rxq->entries[head % NIC_UIO_RXQ_SIZE].slot = slot;
+  rxq->entries[head % NIC_UIO_RXQ_SIZE].len = len;
+  smp_store_release(&rxq->head, head + 1);
+  return true;
+}
+
+// hand released slots back in ring order, one tail write
+static void nic_uio_clean_rx(struct nic_adapter *adapter) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  bool sync = false;
+
+  lockdep_assert_held(&adapter->uio_rx_lock);
+
+  while (rx_ring->next_to_clean != rx_ring->next_to_use &&
+         !(rx_ring->bd_va[rx_ring->next_to_clean].flags & NIC_BD_FLAG_VALID)) {
+    rx_ring->next_to_clean = NIC_RING_WRAP(rx_ring, rx_ring->next_to_clean + 1);
+
+    if (NIC_RING_WRAP(rx_ring, rx_ring->last_sync - rx_ring->next_to_clean) <=
+        READ_ONCE(adapter->rx_sync_num) / 2) {
+      // uio readers and mappings need the coherent frames back
+      nic_rx_post_sync(queue, false);
+      sync = true;
+    }
+  }
+
+  if (sync) {
+    nic_update_rx_tail(queue);
   }
-  nic_set_int(adapter, NIC_VEC_TX, true);
-  kfree(work_ctx);
 }
 
 static void nic_uio_poll_work(struct work_struct *work) {
-  struct uio_poll_work_ctx *work_ctx =
-      container_of(work, struct uio_poll_work_ctx, work);
-  struct nic_adapter *adapter = work_ctx->adapter;
-  struct nic_rx_ring *rx_ring = &adapter->rx_ring;
+  struct nic_queue *queue = container_of(work, struct nic_queue, uio_poll_work);
+  struct nic_adapter *adapter = queue->adapter;
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  struct nic_uio_rxq *rxq;
   struct nic_bd *bd;
+  bool delivered = false;
+  bool dropped = false;
   // netdev_info(adapter->netdev, "nic_uio_poll_work\n");
+
+  // frames are read in place and handed back by nic_uio_release_rx. the
+  // vector stays masked until then, nic_uio_rearm_rx unmasks it
+  if (atomic_read(&adapter->uio_rx_mmaps)) {
+    if (!(rx_ring->bd_va[rx_ring->next_to_use].flags & NIC_BD_FLAG_VALID)) {
+      nic_uio_rearm_rx(adapter);
+      return;
+    }
+    nic_set_int(queue, NIC_VEC_RX, false);
+    rcu_read_lock();
+    rxq = rcu_dereference(adapter->uio_rxq);
+    if (rxq) {
+      wake_up(&rxq->wait);
+    }
+    rcu_read_unlock();
+    if (!list_empty(&adapter->uio_uring_rx)) {
+      nic_cdev_uring_kick(adapter, &adapter->uio_uring_rx);
+    }
+    return;
+  }
+
+  rcu_read_lock();
+  rxq = rcu_dereference(adapter->uio_rxq);
   while (1) {
     bd = &rx_ring->bd_va[rx_ring->next_to_use];
     if (!(bd->flags & NIC_BD_FLAG_VALID)) {
       break;
     }
 
-    if (down_timeout(&adapter->raw_rx_wait_sema, NIC_UIO_RX_TIMEOUT_JIFFIES) ==
-        0) {
-      adapter->uio_rx_buf->buf = rx_ring->data_vas[rx_ring->next_to_use];
-      adapter->uio_rx_buf->len = bd->len;
-
-      // wake up user
-      up(&adapter->raw_rx_sema);
+    // never wait for the reader, drop when it falls behind
+    if (rxq && nic_uio_rxq_push(rxq, rx_ring->next_to_use,
+                                le16_to_cpu(bd->len))) {
+      NIC_STATS_INC(queue, rx_packets);
+      NIC_STATS_ADD(queue, rx_bytes, le16_to_cpu(bd->len));
+      delivered = true;
+    } else {
+      NIC_STATS_INC(queue, rx_dropped);
+      if (rxq) {
+        rxq->drops++;
+      } else {
+        adapter->uio_rx_drops++;
+      }
+      bd->flags &= ~NIC_BD_FLAG_VALID;
+      dropped = true;
     }
-
-    bd->flags &= ~NIC_BD_FLAG_VALID;
     // bd->flags &= ~NIC_BD_FLAG_USED;
-    rx_ring->next_to_use = (rx_ring->next_to_use + 1) % rx_ring->bd_size;
+    rx_ring->next_to_use = NIC_RING_WRAP(rx_ring, rx_ring->next_to_use + 1);
   }
 
-  nic_set_int(adapter, NIC_VEC_RX, true);
-  kfree(work_ctx);
+  // wake up user
+  if (delivered) {
+    wake_up(&rxq->wait);
+  }
+  rcu_read_unlock();
+
+  if (delivered && !list_empty(&adapter->uio_uring_rx)) {
+    nic_cdev_uring_kick(adapter, &adapter->uio_uring_rx);
+  }
+
+  if (dropped) {
+    spin_lock(&adapter->uio_rx_lock);
+    nic_uio_clean_rx(adapter);
+    spin_unlock(&adapter->uio_rx_lock);
+  }
+
+  nic_set_int(queue, NIC_VEC_RX, true);
 }
 
-void nic_uio_xmit_frame(struct nic_adapter *adapter,
-                        struct nic_uio_tx_buf *uio_tx_buf) {
-  struct nic_tx_ring *tx_ring;
+// uio readers index the coherent frames by slot, but napi refills may
+// have left pool pages on posted slots. the uio queue is set up again on
+// coherent frames before it is handed over
+int nic_uio_enable(struct nic_adapter *adapter) {
+  struct net_device *netdev = adapter->netdev;
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  bool running;
+  bool pooled = false;
+  int err = 0;
+  u16 i;
+
+  // dev_open and dev_close run under rtnl, the state holds until unlock
+  rtnl_lock();
+  running = netif_running(netdev);
+  if (adapter->uio_enabled) {
+    goto out;
+  }
+  // an af_xdp socket owns the rings
+  if (queue->xsk_pool) {
+    netdev_err(netdev, "queue %d has an xsk pool\n", NIC_UIO_QUEUE);
+    err = -EBUSY;
+    goto out;
+  }
+
+  adapter->uio_enabled = 1;
+  nic_xdp_set_target(adapter, false);
+  // a poll that started before the switch may still refill from the pool
+  if (running) {
+    napi_disable(&queue->napi);
+    napi_enable(&queue->napi);
+  }
+  for (i = 0; i < queue->rx_ring.bd_size; i++) {
+    pooled |= !!queue->rx_ring.pages[i];
+  }
+  if (!pooled) {
+    goto out;
+  }
+
+  if (down_trylock(&adapter->raw_sema)) {
+    err = -EBUSY;
+    goto err_disable;
+  }
+  if (atomic_read(&adapter->uio_mmaps)) {
+    err = -EBUSY;
+    goto err_up;
+  }
+  if (running) {
+    nic_close(netdev);
+  }
+  nic_free_queue(queue);
+  err = nic_alloc_queue(queue);
+  if (err) {
+    netdev_err(netdev, "queue %d setup failed\n", NIC_UIO_QUEUE);
+    netif_device_detach(netdev);
+  }
+  if (running && !err) {
+    err = nic_open(netdev);
+    // a failed open leaves no rings to redirect to
+    running = !err;
+  }
+  up(&adapter->raw_sema);
+  if (err) {
+    goto err_disable;
+  }
+  goto out;
+
+err_up:
+  up(&adapter->raw_sema);
+err_disable:
+  adapter->uio_enabled = 0;
+  nic_xdp_set_target(adapter, running && netif_device_present(netdev));
+out:
+  rtnl_unlock();
+  return err;
+}
+
+int nic_uio_disable(struct nic_adapter *adapter) {
+  struct net_device *netdev = adapter->netdev;
+  int err = 0;
+
+  rtnl_lock();
+  // napi would refill the mapped slots with pool pages
+  if (atomic_read(&adapter->uio_rx_mmaps)) {
+    netdev_err(netdev, "rx frames are mapped\n");
+    err = -EBUSY;
+    goto out;
+  }
+  adapter->uio_enabled = 0;
+  nic_xdp_set_target(adapter, netif_running(netdev) &&
+                                  netif_device_present(netdev));
+out:
+  rtnl_unlock();
+  return err;
+}
+
+void nic_uio_attach_rxq(struct nic_adapter *adapter, struct nic_uio_rxq *rxq) {
+  rxq->head = 0;
+  rxq->tail = 0;
+  rxq->drops = 0;
+  rcu_assign_pointer(adapter->uio_rxq, rxq);
+}
+
+void nic_uio_detach_rxq(struct nic_adapter *adapter, struct nic_uio_rxq *rxq) {
+  struct nic_rx_ring *rx_ring = &adapter->queues[NIC_UIO_QUEUE].rx_ring;
+  u32 tail;
+
+  RCU_INIT_POINTER(adapter->uio_rxq, NULL);
+  // wait for the poll work to stop pushing
+  synchronize_rcu();
+
+  // frames nobody read go back to the device
+  for (tail = rxq->tail; tail != rxq->head; tail++) {
+    rx_ring->bd_va[rxq->entries[tail % NIC_UIO_RXQ_SIZE].slot].flags &=
+        ~NIC_BD_FLAG_VALID;
+  }
+  rxq->tail = tail;
+
+  spin_lock(&adapter->uio_rx_lock);
+  nic_uio_clean_rx(adapter);
+  spin_unlock(&adapter->uio_rx_lock);
+}
+
+int nic_uio_release_rx(struct nic_adapter *adapter, u16 count) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
   struct nic_bd *bd;
-  u16 next_to_use;
-  int err;
+  int released = 0;
 
-  netdev_info(adapter->netdev, "nic_uio_xmit_frame\n");
-  netdev_info(adapter->netdev, "uio_tx_buf->len: %u\n", uio_tx_buf->len);
+  spin_lock(&adapter->uio_rx_lock);
+  while (released < count) {
+    bd = &rx_ring->bd_va[rx_ring->next_to_use];
+    if (!(bd->flags & NIC_BD_FLAG_VALID)) {
+      break;
+    }
 
-  tx_ring = &adapter->tx_ring;
-  next_to_use = tx_ring->next_to_use;
-  bd = tx_ring->bd_va + next_to_use;
+    bd->flags &= ~NIC_BD_FLAG_VALID;
+    rx_ring->next_to_use = NIC_RING_WRAP(rx_ring, rx_ring->next_to_use + 1);
+    released++;
+  }
 
-  bd->len = cpu_to_le16(uio_tx_buf->len);
-  tx_ring->data_vas[next_to_use] =
-      dma_alloc_coherent(&adapter->pdev->dev, bd->len, &bd->addr, GFP_KERNEL);
+  // one tail write for the whole batch
+  nic_uio_clean_rx(adapter);
+  spin_unlock(&adapter->uio_rx_lock);
 
-  netdev_info(adapter->netdev, "bd->addr: %llx\n", bd->addr);
+  nic_uio_rearm_rx(adapter);
+  return released;
+}
 
-  err =
-      copy_from_user(tx_ring->data_vas[next_to_use], uio_tx_buf->buf, bd->len);
-  if (err) {
-    netdev_err(adapter->netdev, "copy_from_user failed\n");
+// unmask the rx vector the poll work left masked for the consumer. frames
+// that landed meanwhile raised nothing, the poll work picks them up
+void nic_uio_rearm_rx(struct nic_adapter *adapter) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+
+  if (!netif_running(adapter->netdev)) {
     return;
   }
+  nic_set_int(queue, NIC_VEC_RX, true);
+  if (rx_ring->bd_va[READ_ONCE(rx_ring->next_to_use)].flags &
+      NIC_BD_FLAG_VALID) {
+    queue_work(nic_uio_poll_wq, &queue->uio_poll_work);
+  }
+}
+
+bool nic_uio_rx_pending(struct nic_adapter *adapter, struct nic_uio_rxq *rxq) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
 
-  tx_ring->next_to_use = (next_to_use + 1) % tx_ring->bd_size;
+  if (atomic_read(&adapter->uio_rx_mmaps)) {
+    return rx_ring->bd_va[READ_ONCE(rx_ring->next_to_use)].flags &
+           NIC_BD_FLAG_VALID;
+  }
+  return READ_ONCE(rxq->head) != rxq->tail;
+}
+
+u16 nic_uio_tx_free(struct nic_tx_ring *tx_ring) {
+  return tx_ring->bd_size - 1 -
+         NIC_RING_WRAP(tx_ring, tx_ring->next_to_use - tx_ring->next_to_clean);
+}
+
+static void nic_uio_post_tx(struct nic_queue *queue, frame_len_t len) {
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  u16 next_to_use = tx_ring->next_to_use;
+  struct nic_bd *bd = tx_ring->bd_va + next_to_use;
+
+  bd->flags = cpu_to_le64(len | NIC_BD_FLAG_EOP);
+  bd->addr = cpu_to_le64(tx_ring->uio_data_pa +
+                         sizeof(struct nic_tx_frame) * next_to_use);
+  tx_ring->buffers[next_to_use].skb = NULL;
+  tx_ring->buffers[next_to_use].xdpf = NULL;
+  tx_ring->buffers[next_to_use].len = 0;
+
+  trace_nic_xmit(queue, next_to_use, len);
+  tx_ring->next_to_use = NIC_RING_WRAP(tx_ring, next_to_use + 1);
+  NIC_STATS_INC(queue, tx_packets);
+  NIC_STATS_ADD(queue, tx_bytes, len);
+}
+
+int nic_uio_xmit_frame(struct nic_adapter *adapter,
+                       struct nic_uio_tx_buf *uio_tx_buf) {
+  struct nic_burst_frame frame;
+  int sent;
+
+  frame.buf = (u64)(uintptr_t)uio_tx_buf->buf;
+  frame.len = uio_tx_buf->len;
+  sent = nic_uio_xmit_burst(adapter, &frame, 1);
+  if (sent < 0) {
+    return sent;
+  }
+  return sent ? 0 : -EAGAIN;
+}
+
+int nic_uio_xmit_burst(struct nic_adapter *adapter,
+                       struct nic_burst_frame *frames, u16 count) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  int sent = 0;
+  int err = 0;
+
+  mutex_lock(&adapter->uio_tx_lock);
+  if (count > nic_uio_tx_free(tx_ring)) {
+    NIC_STATS_INC(queue, tx_ring_full);
+    count = nic_uio_tx_free(tx_ring);
+  }
+  while (sent < count) {
+    if (frames[sent].len > NIC_TX_PKT_SIZE) {
+      err = -EMSGSIZE;
+      break;
+    }
+    if (copy_from_user(tx_ring->uio_data_va + tx_ring->next_to_use,
+                       u64_to_user_ptr(frames[sent].buf), frames[sent].len)) {
+      err = -EFAULT;
+      break;
+    }
+    nic_uio_post_tx(queue, frames[sent].len);
+    sent++;
+  }
+
+  if (sent) {
+    WRITE_ONCE(tx_ring->uio_ctl->next_to_use, tx_ring->next_to_use);
+    // one doorbell for the whole burst
+    dma_wmb();
+    nic_update_tx_tail(queue);
+  }
+  mutex_unlock(&adapter->uio_tx_lock);
+
+  return sent ? sent : err;
+}
+
+int nic_uio_recv_burst(struct nic_adapter *adapter, struct nic_uio_rxq *rxq,
+                       struct nic_burst_frame *frames, u16 count) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_rx_ring *rx_ring = &queue->rx_ring;
+  struct nic_uio_rxq_entry *entry;
+  struct nic_rx_frame *frame;
+  u32 tail = rxq->tail;
+  u32 head = smp_load_acquire(&rxq->head);
+  frame_len_t len;
+  int recv = 0;
+  int err = 0;
+
+  while (recv < count && tail != head) {
+    entry = &rxq->entries[tail % NIC_UIO_RXQ_SIZE];
+    frame = rx_ring->data_vas[entry->slot];
+    len = min(entry->len, frames[recv].len);
+    nic_rx_sync_for_cpu(queue, entry->slot, len);
+    if (copy_to_user(u64_to_user_ptr(frames[recv].buf), frame->data, len)) {
+      err = -EFAULT;
+      break;
+    }
+    if (len < entry->len) {
+      NIC_STATS_INC(queue, uio_rx_truncated);
+    }
+    // the full length tells the caller its buffer was too short
+    frames[recv].len = entry->len;
+    frames[recv].if_id = adapter->if_id;
+
+    rx_ring->bd_va[entry->slot].flags &= ~NIC_BD_FLAG_VALID;
+    tail++;
+    recv++;
+  }
+  smp_store_release(&rxq->tail, tail);
+
+  // hand the whole batch back with one tail write
+  if (recv) {
+    spin_lock(&adapter->uio_rx_lock);
+    nic_uio_clean_rx(adapter);
+    spin_unlock(&adapter->uio_rx_lock);
+  }
+
+  return recv ? recv : err;
+}
+
+int nic_uio_kick_tx(struct nic_adapter *adapter, u16 count) {
+  struct nic_queue *queue = &adapter->queues[NIC_UIO_QUEUE];
+  struct nic_tx_ring *tx_ring = &queue->tx_ring;
+  struct nic_uio_tx_ctl *ctl = tx_ring->uio_ctl;
+  frame_len_t len;
+  int posted = 0;
+  int err = 0;
+
+  mutex_lock(&adapter->uio_tx_lock);
+  if (count > nic_uio_tx_free(tx_ring)) {
+    NIC_STATS_INC(queue, tx_ring_full);
+    count = nic_uio_tx_free(tx_ring);
+  }
+  while (posted < count) {
+    len = READ_ONCE(ctl->len[tx_ring->next_to_use]);
+    // the ctl page is written by userspace
+    if (len > NIC_TX_PKT_SIZE) {
+      NIC_STATS_INC(queue, uio_tx_bad_len);
+      if (net_ratelimit()) {
+        netdev_err(adapter->netdev, "uio tx slot %u: invalid len %u\n",
+                   tx_ring->next_to_use, len);
+      }
+      err = -EINVAL;
+      break;
+    }
+    nic_uio_post_tx(queue, len);
+    posted++;
+  }
+
+  if (posted) {
+    WRITE_ONCE(ctl->next_to_use, tx_ring->next_to_use);
+    // one doorbell for the whole burst
+    dma_wmb();
+    nic_update_tx_tail(queue);
+  }
+  mutex_unlock(&adapter->uio_tx_lock);
 
-  nic_update_tx_tail(adapter);
+  return posted ? posted : err;
 }
 
 #endif // PCI_FN_TEST
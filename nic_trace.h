@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// data path tracepoints, perf list 'pangonic:*'
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pangonic
+
+#if !defined(_NIC_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _NIC_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+#include "nic.h"
+
+DECLARE_EVENT_CLASS(nic_desc_class,
+                    TP_PROTO(struct nic_queue *queue, u16 slot, u32 len),
+                    TP_ARGS(queue, slot, len),
+                    TP_STRUCT__entry(__field(u16, if_id) __field(u16, queue)
+                                         __field(u16, slot) __field(u32, len)),
+                    TP_fast_assign(__entry->if_id = queue->adapter->if_id;
+                                   __entry->queue = queue->id;
+                                   __entry->slot = slot; __entry->len = len;),
+                    TP_printk("if=%u queue=%u slot=%u len=%u", __entry->if_id,
+                              __entry->queue, __entry->slot, __entry->len));
+
+// a tx descriptor was posted, by the stack or the raw cdev
+DEFINE_EVENT(nic_desc_class, nic_xmit,
+             TP_PROTO(struct nic_queue *queue, u16 slot, u32 len),
+             TP_ARGS(queue, slot, len));
+
+// the device handed back a filled rx descriptor
+DEFINE_EVENT(nic_desc_class, nic_rx_desc,
+             TP_PROTO(struct nic_queue *queue, u16 slot, u32 len),
+             TP_ARGS(queue, slot, len));
+
+// a completed tx descriptor was reclaimed
+DEFINE_EVENT(nic_desc_class, nic_tx_clean,
+             TP_PROTO(struct nic_queue *queue, u16 slot, u32 len),
+             TP_ARGS(queue, slot, len));
+
+// tail register write, tx_rx is NIC_VEC_TX or NIC_VEC_RX
+TRACE_EVENT(nic_doorbell,
+            TP_PROTO(struct nic_queue *queue, int tx_rx, u16 tail),
+            TP_ARGS(queue, tx_rx, tail),
+            TP_STRUCT__entry(__field(u16, if_id) __field(u16, queue)
+                                 __field(int, tx_rx) __field(u16, tail)),
+            TP_fast_assign(__entry->if_id = queue->adapter->if_id;
+                           __entry->queue = queue->id;
+                           __entry->tx_rx = tx_rx; __entry->tail = tail;),
+            TP_printk("if=%u queue=%u %s tail=%u", __entry->if_id,
+                      __entry->queue, __entry->tx_rx ? "rx" : "tx",
+                      __entry->tail));
+
+TRACE_EVENT(nic_poll, TP_PROTO(struct nic_queue *queue, int budget,
+                               int work_done, bool tx_complete),
+            TP_ARGS(queue, budget, work_done, tx_complete),
+            TP_STRUCT__entry(__field(u16, if_id) __field(u16, queue)
+                                 __field(int, budget) __field(int, work_done)
+                                     __field(bool, tx_complete)),
+            TP_fast_assign(__entry->if_id = queue->adapter->if_id;
+                           __entry->queue = queue->id;
+                           __entry->budget = budget;
+                           __entry->work_done = work_done;
+                           __entry->tx_complete = tx_complete;),
+            TP_printk("if=%u queue=%u budget=%d work_done=%d tx_complete=%d",
+                      __entry->if_id, __entry->queue, __entry->budget,
+                      __entry->work_done, __entry->tx_complete));
+
+// vector mask register write
+TRACE_EVENT(nic_set_int, TP_PROTO(struct nic_queue *queue, int nr, bool enable),
+            TP_ARGS(queue, nr, enable),
+            TP_STRUCT__entry(__field(u16, if_id) __field(u16, queue)
+                                 __field(int, nr) __field(bool, enable)),
+            TP_fast_assign(__entry->if_id = queue->adapter->if_id;
+                           __entry->queue = queue->id; __entry->nr = nr;
+                           __entry->enable = enable;),
+            TP_printk("if=%u queue=%u vec=%d %s", __entry->if_id,
+                      __entry->queue, __entry->nr,
+                      __entry->enable ? "enable" : "disable"));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nic_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,280 @@
+#include "sim.h"
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// host side of one channel, the ring handling of nic_main.c in userspace
+
+struct bench_tx {
+  struct sim *sim;
+  int ch;
+  struct nic_bd *bd;
+  uint8_t *frames;
+  dma_addr_t frames_iova;
+  uint16_t next_to_use;
+  uint16_t next_to_clean;
+  uint16_t last_sync;
+  uint64_t doorbells;
+};
+
+struct bench_rx {
+  struct sim *sim;
+  int ch;
+  struct nic_bd *bd;
+  uint16_t next_to_use;
+  uint16_t last_sync;
+  uint64_t frames;
+  uint64_t bytes;
+  // frames whose first byte is not what bench_tx_init wrote
+  uint64_t corrupt;
+  uint64_t doorbells;
+};
+
+static struct sim_config cfg = {
+    .ring_size = NIC_TX_RING_QUEUES,
+    .num_queues = 1,
+    .link_mbps = 10000,
+    .dma_latency_ns = 1000,
+    .dma_size = 64 << 20,
+};
+
+static uint32_t frame_size = 64;
+static uint32_t tx_batch = 4;
+static uint32_t rx_sync = 4;
+static uint32_t seconds = 5;
+static volatile int stop;
+
+static int bench_tx_init(struct bench_tx *tx, struct sim *sim, int ch) {
+  dma_addr_t iova;
+  uint32_t i;
+
+  tx->sim = sim;
+  tx->ch = ch;
+  tx->bd = sim_dma_alloc(sim, sizeof(struct nic_bd) * cfg.ring_size, &iova);
+  tx->frames = sim_dma_alloc(sim, sizeof(struct nic_tx_frame) * cfg.ring_size,
+                             &tx->frames_iova);
+  if (!tx->bd || !tx->frames) {
+    return -1;
+  }
+  for (i = 0; i < cfg.ring_size; i++) {
+    memset(tx->frames + i * sizeof(struct nic_tx_frame), 0xff, 12);
+  }
+  sim_reg_write(sim, ch, NIC_PCIE_REG_TX_BD_BA_LOW, iova & 0xffffffff);
+  sim_reg_write(sim, ch, NIC_PCIE_REG_TX_BD_BA_HIGH, iova >> 32);
+  return 0;
+}
+
+static int bench_rx_init(struct bench_rx *rx, struct sim *sim, int ch) {
+  dma_addr_t iova, buf_iova;
+  uint32_t i;
+
+  rx->sim = sim;
+  rx->ch = ch;
+  rx->bd = sim_dma_alloc(sim, sizeof(struct nic_bd) * cfg.ring_size, &iova);
+  if (!rx->bd ||
+      !sim_dma_alloc(sim, sizeof(struct nic_rx_frame) * cfg.ring_size,
+                     &buf_iova)) {
+    return -1;
+  }
+  for (i = 0; i < cfg.ring_size; i++) {
+    rx->bd[i].addr = buf_iova + i * sizeof(struct nic_rx_frame);
+  }
+  sim_reg_write(sim, ch, NIC_PCIE_REG_RX_BD_BA_LOW, iova & 0xffffffff);
+  sim_reg_write(sim, ch, NIC_PCIE_REG_RX_BD_BA_HIGH, iova >> 32);
+  // one slot stays with the host, head == tail is an empty ring
+  rx->last_sync = cfg.ring_size - 1;
+  sim_reg_write(sim, ch, NIC_PCIE_REG_RX_BD_TAIL, rx->last_sync);
+  return 0;
+}
+
+static uint16_t bench_tx_free(struct bench_tx *tx) {
+  return cfg.ring_size - 1 -
+         ((tx->next_to_use - tx->next_to_clean) & (cfg.ring_size - 1));
+}
+
+static void *bench_tx_thread(void *arg) {
+  struct bench_tx *tx = arg;
+  uint16_t mask = cfg.ring_size - 1;
+  uint16_t slot;
+
+  while (!stop) {
+    // nic_clean_tx_ring
+    while (tx->next_to_clean != tx->next_to_use &&
+           __atomic_load_n(&tx->bd[tx->next_to_clean].flags,
+                           __ATOMIC_ACQUIRE) &
+               NIC_BD_FLAG_VALID) {
+      tx->bd[tx->next_to_clean].flags &= ~NIC_BD_FLAG_VALID;
+      tx->next_to_clean = (tx->next_to_clean + 1) & mask;
+    }
+
+    // nic_xmit_frame, the doorbell rings every tx_batch frames
+    while (bench_tx_free(tx)) {
+      slot = tx->next_to_use;
+      tx->bd[slot].addr = tx->frames_iova + slot * sizeof(struct nic_tx_frame);
+      __atomic_store_n(&tx->bd[slot].flags, frame_size | NIC_BD_FLAG_EOP,
+                       __ATOMIC_RELEASE);
+      tx->next_to_use = (slot + 1) & mask;
+      if (((tx->next_to_use - tx->last_sync) & mask) >= tx_batch) {
+        sim_reg_write(tx->sim, tx->ch, NIC_PCIE_REG_TX_BD_TAIL,
+                      tx->next_to_use);
+        tx->last_sync = tx->next_to_use;
+        tx->doorbells++;
+      }
+    }
+    sched_yield();
+  }
+  return NULL;
+}
+
+static void *bench_rx_thread(void *arg) {
+  struct bench_rx *rx = arg;
+  uint16_t mask = cfg.ring_size - 1;
+  struct nic_bd *bd;
+  uint64_t flags;
+  uint8_t *data;
+
+  while (!stop) {
+    // nic_poll
+    bd = &rx->bd[rx->next_to_use];
+    flags = __atomic_load_n(&bd->flags, __ATOMIC_ACQUIRE);
+    if (!(flags & NIC_BD_FLAG_VALID)) {
+      sched_yield();
+      continue;
+    }
+    data = sim_iova_to_va(rx->sim, bd->addr, flags & 0xffff);
+    rx->bytes += flags & 0xffff;
+    if (flags & NIC_BD_FLAG_EOP) {
+      rx->frames++;
+    }
+    if (!data || data[0] != 0xff) {
+      rx->corrupt++;
+    }
+    bd->flags = 0;
+    rx->next_to_use = (rx->next_to_use + 1) & mask;
+
+    // nic_rx_post_sync
+    if (((rx->last_sync - rx->next_to_use) & mask) <= mask - rx_sync) {
+      rx->last_sync = (rx->last_sync + rx_sync) & mask;
+      sim_reg_write(rx->sim, rx->ch, NIC_PCIE_REG_RX_BD_TAIL, rx->last_sync);
+      rx->doorbells++;
+    }
+  }
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  printf("usage: %s [-s frame size] [-b tx batch] [-y rx sync] "
+         "[-n ring size] [-r link mbps] [-l dma latency ns] [-t seconds] "
+         "[-S] [-R] [-E]\n",
+         prog);
+  printf("  -S  loop port 0 back to itself instead of to port 1\n");
+  printf("  -R  model a ring size register, the device takes -n\n");
+  printf("  -E  model eop support, frames may span descriptors\n");
+}
+
+int main(int argc, char **argv) {
+  struct sim_port_stats *tx_stats, *rx_stats;
+  struct bench_tx tx = {0};
+  struct bench_rx rx = {0};
+  pthread_t tx_thread, rx_thread;
+  uint64_t start, elapsed, frames, bytes;
+  struct sim *sim;
+  int rx_ch;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:b:y:n:r:l:t:SREh")) != -1) {
+    switch (opt) {
+    case 's':
+      frame_size = atoi(optarg);
+      break;
+    case 'b':
+      tx_batch = atoi(optarg);
+      break;
+    case 'y':
+      rx_sync = atoi(optarg);
+      break;
+    case 'n':
+      cfg.ring_size = atoi(optarg);
+      break;
+    case 'r':
+      cfg.link_mbps = strtoull(optarg, NULL, 0);
+      break;
+    case 'l':
+      cfg.dma_latency_ns = strtoull(optarg, NULL, 0);
+      break;
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    case 'S':
+      cfg.loopback_self = true;
+      break;
+    case 'R':
+      cfg.ring_size_reg = true;
+      break;
+    case 'E':
+      cfg.eop = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (frame_size < 14 || frame_size > NIC_RX_PKT_SIZE || !tx_batch ||
+      !rx_sync || tx_batch >= cfg.ring_size || rx_sync > cfg.ring_size / 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  sim = sim_create(&cfg);
+  if (!sim) {
+    perror("sim_create");
+    return 1;
+  }
+  rx_ch = cfg.loopback_self ? NIC_QUEUE_CH(0, 0) : NIC_QUEUE_CH(1, 0);
+  if (bench_tx_init(&tx, sim, NIC_QUEUE_CH(0, 0)) ||
+      bench_rx_init(&rx, sim, rx_ch)) {
+    printf("dma region too small\n");
+    sim_destroy(sim);
+    return 1;
+  }
+  if (sim_start(sim)) {
+    printf("sim_start failed\n");
+    sim_destroy(sim);
+    return 1;
+  }
+
+  printf("frame %u B, ring %u (device %u), tx batch %u, rx sync %u, "
+         "link %lu Mb/s, dma latency %lu ns, eop %s\n",
+         frame_size, cfg.ring_size, sim->ring_size, tx_batch, rx_sync,
+         cfg.link_mbps, cfg.dma_latency_ns, cfg.eop ? "on" : "off");
+  start = sim_now_ns();
+  pthread_create(&rx_thread, NULL, bench_rx_thread, &rx);
+  pthread_create(&tx_thread, NULL, bench_tx_thread, &tx);
+  sleep(seconds);
+  stop = 1;
+  pthread_join(tx_thread, NULL);
+  pthread_join(rx_thread, NULL);
+  elapsed = sim_now_ns() - start;
+  sim_stop(sim);
+
+  tx_stats = &sim->ports[0].stats;
+  rx_stats = &sim->ports[rx_ch % NIC_IF_NUM].stats;
+  frames = rx.frames;
+  bytes = rx.bytes;
+  printf("tx %lu frames, %lu doorbells (%.2f frames/doorbell)\n",
+         tx_stats->tx_frames, tx.doorbells,
+         tx.doorbells ? (double)tx_stats->tx_frames / tx.doorbells : 0.0);
+  printf("rx %lu frames, %.3f Mpps, %.3f Gb/s, %lu tail writes\n", frames,
+         frames * 1e3 / elapsed, bytes * 8.0 / elapsed, rx.doorbells);
+  printf("rx drops: no desc %lu, overrun %lu, oversize %lu, dma errors %lu, "
+         "corrupt %lu\n",
+         rx_stats->rx_no_desc, rx_stats->rx_overrun, rx_stats->rx_oversize,
+         tx_stats->dma_errors + rx_stats->dma_errors, rx.corrupt);
+
+  sim_destroy(sim);
+  return 0;
+}
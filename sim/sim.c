@@ -0,0 +1,393 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+uint64_t sim_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t *sim_reg_addr(struct sim *sim, int ch, int reg) {
+  return (uint32_t *)(sim->bar + NIC_CTL_ADDR(0, ch, 0) +
+                      NIC_REG_TO_ADDR(reg));
+}
+
+void sim_reg_write(struct sim *sim, int ch, int reg, uint32_t val) {
+  __atomic_store_n(sim_reg_addr(sim, ch, reg), val, __ATOMIC_RELEASE);
+}
+
+uint32_t sim_reg_read(struct sim *sim, int ch, int reg) {
+  return __atomic_load_n(sim_reg_addr(sim, ch, reg), __ATOMIC_ACQUIRE);
+}
+
+void *sim_dma_alloc(struct sim *sim, size_t size, dma_addr_t *iova) {
+  size_t off = (sim->dma_used + 63) & ~(size_t)63;
+
+  if (off + size > sim->cfg.dma_size) {
+    return NULL;
+  }
+  sim->dma_used = off + size;
+  *iova = SIM_IOVA_BASE + off;
+  return sim->dma + off;
+}
+
+void *sim_iova_to_va(struct sim *sim, dma_addr_t iova, size_t len) {
+  if (iova < SIM_IOVA_BASE || iova - SIM_IOVA_BASE + len > sim->cfg.dma_size) {
+    return NULL;
+  }
+  return sim->dma + (iova - SIM_IOVA_BASE);
+}
+
+static struct nic_bd *sim_bd(struct sim *sim, int ch, int tx_rx, uint16_t i) {
+  uint64_t ba;
+
+  if (tx_rx == NIC_VEC_TX) {
+    ba = sim_reg_read(sim, ch, NIC_PCIE_REG_TX_BD_BA_LOW) |
+         (uint64_t)sim_reg_read(sim, ch, NIC_PCIE_REG_TX_BD_BA_HIGH) << 32;
+  } else {
+    ba = sim_reg_read(sim, ch, NIC_PCIE_REG_RX_BD_BA_LOW) |
+         (uint64_t)sim_reg_read(sim, ch, NIC_PCIE_REG_RX_BD_BA_HIGH) << 32;
+  }
+  if (!ba) {
+    return NULL;
+  }
+  return sim_iova_to_va(sim, ba + i * sizeof(struct nic_bd),
+                        sizeof(struct nic_bd));
+}
+
+static void sim_irq(struct sim *sim, int ch, int vec) {
+  struct sim_port *port = &sim->ports[ch % NIC_IF_NUM];
+
+  if (!sim_reg_read(sim, ch, NIC_PCIE_REG_INT_OFFSET(vec))) {
+    return;
+  }
+  port->stats.irqs++;
+  if (sim->cfg.irq) {
+    sim->cfg.irq(sim->cfg.irq_arg, ch, vec);
+  }
+}
+
+static uint64_t sim_wire_ns(struct sim *sim, uint32_t len) {
+  if (!sim->cfg.link_mbps) {
+    return 0;
+  }
+  return (uint64_t)(len + SIM_WIRE_OVERHEAD) * 8 * 1000 / sim->cfg.link_mbps;
+}
+
+static int sim_peer_ch(struct sim *sim, int ch) {
+  int port = ch % NIC_IF_NUM;
+  int q = ch / NIC_IF_NUM;
+
+  if (sim->cfg.loopback_self) {
+    return ch;
+  }
+  return NIC_QUEUE_CH((port + 1) % NIC_IF_NUM, q);
+}
+
+// fetch whole frames between tx_head and the tail, they leave the port
+// back to back and land in the fifo of the peer channel
+static int sim_tx_fetch(struct sim *sim, int ch) {
+  struct sim_ch *c = &sim->chs[ch];
+  struct sim_port *port = &sim->ports[ch % NIC_IF_NUM];
+  struct sim_fifo *fifo = &sim->chs[sim_peer_ch(sim, ch)].rx_fifo;
+  uint16_t mask = sim->ring_size - 1;
+  uint16_t tail = sim_reg_read(sim, ch, NIC_PCIE_REG_TX_BD_TAIL) & mask;
+  struct sim_rx_slot *slot;
+  struct nic_bd *bd;
+  uint64_t flags, start, now;
+  uint32_t len, head;
+  uint16_t i, nbd;
+  int frames = 0;
+  void *va;
+
+  while (c->tx_head != tail) {
+    // the engine does not run further ahead of the wire than one fetch
+    if (port->wire_free_ns > sim_now_ns() + sim->cfg.dma_latency_ns) {
+      return frames;
+    }
+    // a frame is only fetched once its eop bd is posted, without eop
+    // support every bd goes out as a frame of its own
+    for (i = c->tx_head, nbd = 0; i != tail; i = (i + 1) & mask) {
+      bd = sim_bd(sim, ch, NIC_VEC_TX, i);
+      if (!bd) {
+        return frames;
+      }
+      nbd++;
+      if (!sim->cfg.eop ||
+          __atomic_load_n(&bd->flags, __ATOMIC_ACQUIRE) & NIC_BD_FLAG_EOP) {
+        break;
+      }
+    }
+    if (i == tail) {
+      return frames;
+    }
+
+    head = fifo->head;
+    slot = NULL;
+    if (head - __atomic_load_n(&fifo->tail, __ATOMIC_ACQUIRE) <
+        SIM_RX_FIFO_SIZE) {
+      slot = &fifo->slots[head % SIM_RX_FIFO_SIZE];
+      slot->len = 0;
+    }
+    len = 0;
+    for (i = 0; i < nbd; i++) {
+      bd = sim_bd(sim, ch, NIC_VEC_TX, (c->tx_head + i) & mask);
+      flags = __atomic_load_n(&bd->flags, __ATOMIC_ACQUIRE);
+      va = sim_iova_to_va(sim, bd->addr, flags & 0xffff);
+      if (!va || len + (flags & 0xffff) > SIM_FRAME_MAX) {
+        port->stats.dma_errors++;
+        continue;
+      }
+      if (slot) {
+        memcpy(slot->data + len, va, flags & 0xffff);
+      }
+      len += flags & 0xffff;
+    }
+
+    now = sim_now_ns();
+    start = now + sim->cfg.dma_latency_ns;
+    if (start < port->wire_free_ns) {
+      start = port->wire_free_ns;
+    }
+    port->wire_free_ns = start + sim_wire_ns(sim, len);
+    c->tx_nbd[c->tx_head] = nbd;
+    c->tx_ts[c->tx_head] = port->wire_free_ns;
+    c->tx_head = (c->tx_head + nbd) & mask;
+    port->stats.tx_frames++;
+    port->stats.tx_bytes += len;
+    frames++;
+
+    if (slot) {
+      slot->len = len;
+      slot->ts = port->wire_free_ns + sim->cfg.dma_latency_ns;
+      __atomic_store_n(&fifo->head, head + 1, __ATOMIC_RELEASE);
+    } else {
+      sim->ports[sim_peer_ch(sim, ch) % NIC_IF_NUM].stats.rx_overrun++;
+    }
+  }
+  return frames;
+}
+
+// hand back the bds of frames that are through the wire
+static int sim_tx_complete(struct sim *sim, int ch, uint64_t now) {
+  struct sim_ch *c = &sim->chs[ch];
+  uint16_t mask = sim->ring_size - 1;
+  struct nic_bd *bd;
+  uint16_t i, nbd;
+  int done = 0;
+
+  while (c->tx_clean != c->tx_head && c->tx_ts[c->tx_clean] <= now) {
+    nbd = c->tx_nbd[c->tx_clean];
+    for (i = 0; i < nbd; i++) {
+      bd = sim_bd(sim, ch, NIC_VEC_TX, (c->tx_clean + i) & mask);
+      if (bd) {
+        __atomic_fetch_or(&bd->flags, NIC_BD_FLAG_VALID, __ATOMIC_RELEASE);
+      }
+    }
+    c->tx_clean = (c->tx_clean + nbd) & mask;
+    done++;
+  }
+  if (done) {
+    sim_irq(sim, ch, NIC_VEC_TX);
+  }
+  return done;
+}
+
+// write arrived frames into the bds the host gave us, NIC_RX_PKT_SIZE per
+// bd, eop on the last one. without eop support a frame takes a single bd
+static int sim_rx_deliver(struct sim *sim, int ch, uint64_t now) {
+  struct sim_ch *c = &sim->chs[ch];
+  struct sim_port *port = &sim->ports[ch % NIC_IF_NUM];
+  struct sim_fifo *fifo = &c->rx_fifo;
+  uint16_t mask = sim->ring_size - 1;
+  struct sim_rx_slot *slot;
+  struct nic_bd *bd;
+  uint32_t off, chunk, nbuf;
+  uint16_t tail, owned;
+  int frames = 0;
+  void *va;
+
+  while (fifo->tail != __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE)) {
+    slot = &fifo->slots[fifo->tail % SIM_RX_FIFO_SIZE];
+    if (slot->ts > now) {
+      break;
+    }
+
+    tail = sim_reg_read(sim, ch, NIC_PCIE_REG_RX_BD_TAIL) & mask;
+    owned = (tail - c->rx_head) & mask;
+    nbuf = (slot->len + NIC_RX_PKT_SIZE - 1) / NIC_RX_PKT_SIZE;
+    if (!nbuf) {
+      port->stats.dma_errors++;
+    } else if (nbuf > 1 && !sim->cfg.eop) {
+      port->stats.rx_oversize++;
+    } else if (owned < nbuf) {
+      port->stats.rx_no_desc++;
+    } else {
+      for (off = 0; off < slot->len; off += NIC_RX_PKT_SIZE) {
+        bd = sim_bd(sim, ch, NIC_VEC_RX, c->rx_head);
+        chunk = slot->len - off;
+        if (chunk > NIC_RX_PKT_SIZE) {
+          chunk = NIC_RX_PKT_SIZE;
+        }
+        va = bd ? sim_iova_to_va(sim, bd->addr, chunk) : NULL;
+        if (!va) {
+          port->stats.dma_errors++;
+          break;
+        }
+        memcpy(va, slot->data + off, chunk);
+        __atomic_store_n(&bd->flags,
+                         chunk | NIC_BD_FLAG_VALID |
+                             (off + chunk >= slot->len ? NIC_BD_FLAG_EOP : 0),
+                         __ATOMIC_RELEASE);
+        c->rx_head = (c->rx_head + 1) & mask;
+      }
+      port->stats.rx_frames++;
+      port->stats.rx_bytes += slot->len;
+      frames++;
+    }
+    __atomic_store_n(&fifo->tail, fifo->tail + 1, __ATOMIC_RELEASE);
+  }
+  if (frames) {
+    sim_irq(sim, ch, NIC_VEC_RX);
+  }
+  return frames;
+}
+
+static void *sim_port_thread(void *arg) {
+  struct sim_port *port = arg;
+  struct sim *sim = port->sim;
+  int nch = sim->cfg.num_queues * NIC_IF_NUM;
+  uint64_t now;
+  int work;
+  int ch;
+
+  while (__atomic_load_n(&sim->running, __ATOMIC_ACQUIRE)) {
+    work = 0;
+    for (ch = port->id; ch < nch; ch += NIC_IF_NUM) {
+      work += sim_tx_fetch(sim, ch);
+      now = sim_now_ns();
+      work += sim_tx_complete(sim, ch, now);
+      work += sim_rx_deliver(sim, ch, now);
+    }
+    if (!work) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+struct sim *sim_create(const struct sim_config *cfg) {
+  struct sim *sim;
+  int ch;
+  int i;
+
+  if ((cfg->ring_size_reg &&
+       (!cfg->ring_size || cfg->ring_size & (cfg->ring_size - 1) ||
+        cfg->ring_size > 65536)) ||
+      !cfg->num_queues || cfg->num_queues * NIC_IF_NUM > SIM_MAX_CH) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sim = calloc(1, sizeof(*sim));
+  if (!sim) {
+    return NULL;
+  }
+  sim->cfg = *cfg;
+  // a host ring of another size is walked as if it had the fixed size,
+  // as on the hardware
+  sim->ring_size = cfg->ring_size_reg ? cfg->ring_size : SIM_HW_RING_SIZE;
+  sim->bar = mmap(NULL, SIM_BAR_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sim->bar == MAP_FAILED) {
+    goto err_bar;
+  }
+  sim->dma = mmap(NULL, cfg->dma_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (sim->dma == MAP_FAILED) {
+    goto err_dma;
+  }
+
+  for (ch = 0; ch < cfg->num_queues * NIC_IF_NUM; ch++) {
+    sim->chs[ch].tx_nbd = calloc(sim->ring_size, sizeof(uint16_t));
+    sim->chs[ch].tx_ts = calloc(sim->ring_size, sizeof(uint64_t));
+    sim->chs[ch].rx_fifo.slots =
+        calloc(SIM_RX_FIFO_SIZE, sizeof(struct sim_rx_slot));
+    if (!sim->chs[ch].tx_nbd || !sim->chs[ch].tx_ts ||
+        !sim->chs[ch].rx_fifo.slots) {
+      goto err_ch;
+    }
+  }
+  for (i = 0; i < NIC_IF_NUM; i++) {
+    sim->ports[i].sim = sim;
+    sim->ports[i].id = i;
+  }
+  return sim;
+
+err_ch:
+  for (ch = 0; ch < SIM_MAX_CH; ch++) {
+    free(sim->chs[ch].tx_nbd);
+    free(sim->chs[ch].tx_ts);
+    free(sim->chs[ch].rx_fifo.slots);
+  }
+  munmap(sim->dma, cfg->dma_size);
+err_dma:
+  munmap(sim->bar, SIM_BAR_SIZE);
+err_bar:
+  free(sim);
+  return NULL;
+}
+
+void sim_destroy(struct sim *sim) {
+  int ch;
+
+  sim_stop(sim);
+  for (ch = 0; ch < SIM_MAX_CH; ch++) {
+    free(sim->chs[ch].tx_nbd);
+    free(sim->chs[ch].tx_ts);
+    free(sim->chs[ch].rx_fifo.slots);
+  }
+  munmap(sim->dma, sim->cfg.dma_size);
+  munmap(sim->bar, SIM_BAR_SIZE);
+  free(sim);
+}
+
+// one device thread per port, it runs the tx and rx engines of every
+// channel of the port
+int sim_start(struct sim *sim) {
+  int err;
+  int i;
+
+  __atomic_store_n(&sim->running, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < NIC_IF_NUM; i++) {
+    err = pthread_create(&sim->ports[i].thread, NULL, sim_port_thread,
+                         &sim->ports[i]);
+    if (err) {
+      __atomic_store_n(&sim->running, 0, __ATOMIC_RELEASE);
+      while (i--) {
+        pthread_join(sim->ports[i].thread, NULL);
+      }
+      return -err;
+    }
+  }
+  return 0;
+}
+
+void sim_stop(struct sim *sim) {
+  int i;
+
+  if (!__atomic_exchange_n(&sim->running, 0, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  for (i = 0; i < NIC_IF_NUM; i++) {
+    pthread_join(sim->ports[i].thread, NULL);
+  }
+}
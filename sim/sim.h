@@ -0,0 +1,149 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// the register map of nic_hw.h, without the kernel half of nic.h
+#define BIT(nr) (1UL << (nr))
+#define _NIC_H_
+struct nic_queue;
+#include "nic_hw.h"
+
+// channel numbers are 7 bits wide, see NIC_CTL_ADDR
+#define SIM_MAX_CH 128
+
+#define SIM_BAR_SIZE (SIM_MAX_CH * NIC_IF_REG_SIZE)
+
+// dma addresses handed to the device are offsets from here
+#define SIM_IOVA_BASE 0x100000000ULL
+
+// largest frame on the wire, a 9000 mtu frame with a vlan tag, frames
+// above NIC_RX_PKT_SIZE need sim_config.eop
+#define SIM_FRAME_MAX 9024
+
+// entries the gateware walks per ring, it has no size register
+#define SIM_HW_RING_SIZE NIC_TX_RING_QUEUES
+
+// frames on the wire towards one channel
+#define SIM_RX_FIFO_SIZE 256
+
+// preamble, sfd, fcs and inter frame gap
+#define SIM_WIRE_OVERHEAD 24
+
+// the defaults model the current gateware, the knobs marked opt-in model
+// features it does not have yet
+struct sim_config {
+  // bd per ring, a power of two as in the driver. only used with
+  // ring_size_reg, otherwise the device walks SIM_HW_RING_SIZE entries
+  uint32_t ring_size;
+  // opt-in, the device has a ring size register
+  bool ring_size_reg;
+  // opt-in, tx frames span bds up to NIC_BD_FLAG_EOP and rx frames above
+  // NIC_RX_PKT_SIZE are split over bds with eop on the last. without it
+  // every tx bd is a frame and larger rx frames are dropped
+  bool eop;
+  // ring pairs per port, channel NIC_QUEUE_CH(port, q)
+  uint32_t num_queues;
+  // 0 is an unlimited link
+  uint64_t link_mbps;
+  // bd fetch to frame data in host memory, both directions
+  uint64_t dma_latency_ns;
+  // port i sends to itself instead of to its sibling
+  bool loopback_self;
+  // host memory the device can reach
+  size_t dma_size;
+  // called from the device thread for an unmasked vector
+  void (*irq)(void *arg, int ch, int vec);
+  void *irq_arg;
+};
+
+struct sim_port_stats {
+  uint64_t tx_frames;
+  uint64_t tx_bytes;
+  uint64_t rx_frames;
+  uint64_t rx_bytes;
+  // no rx descriptor owned by the device when the frame arrived
+  uint64_t rx_no_desc;
+  // the frame did not fit in the fifo of the receiving channel
+  uint64_t rx_overrun;
+  // rx frame above NIC_RX_PKT_SIZE without sim_config.eop
+  uint64_t rx_oversize;
+  // bd pointing outside the dma region, or a frame above SIM_FRAME_MAX
+  uint64_t dma_errors;
+  uint64_t irqs;
+};
+
+struct sim_rx_slot {
+  // when the last byte is in host memory
+  uint64_t ts;
+  uint32_t len;
+  uint8_t data[SIM_FRAME_MAX];
+};
+
+// written by the sending port thread, read by the receiving one
+struct sim_fifo {
+  struct sim_rx_slot *slots;
+  uint32_t head;
+  uint32_t tail;
+};
+
+struct sim_ch {
+  // next tx bd to fetch and next to complete
+  uint16_t tx_head;
+  uint16_t tx_clean;
+  // per first bd of a fetched frame, its bd count and completion time
+  uint16_t *tx_nbd;
+  uint64_t *tx_ts;
+
+  uint16_t rx_head;
+  struct sim_fifo rx_fifo;
+};
+
+struct sim_port {
+  struct sim *sim;
+  int id;
+  pthread_t thread;
+  // the link is busy until then
+  uint64_t wire_free_ns;
+  struct sim_port_stats stats;
+};
+
+struct sim {
+  struct sim_config cfg;
+  // entries the device walks per ring
+  uint32_t ring_size;
+  uint8_t *bar;
+  uint8_t *dma;
+  size_t dma_used;
+  struct sim_ch chs[SIM_MAX_CH];
+  struct sim_port ports[NIC_IF_NUM];
+  int running;
+};
+
+uint64_t sim_now_ns(void);
+
+struct sim *sim_create(const struct sim_config *cfg);
+
+void sim_destroy(struct sim *sim);
+
+int sim_start(struct sim *sim);
+
+void sim_stop(struct sim *sim);
+
+// host side
+
+// registers of NIC_CTL_ADDR(0, ch, 0), reg as in nic_hw.h
+void sim_reg_write(struct sim *sim, int ch, int reg, uint32_t val);
+
+uint32_t sim_reg_read(struct sim *sim, int ch, int reg);
+
+void *sim_dma_alloc(struct sim *sim, size_t size, dma_addr_t *iova);
+
+void *sim_iova_to_va(struct sim *sim, dma_addr_t iova, size_t len);
+
+#endif